@@ -0,0 +1,204 @@
+// Handlers per second of EventProcessor dispatch against the virtual IEventHandler dispatch it replaced
+// Build: the dispatch_bench target, or g++ -std=c++20 -O2 -pthread -I.. dispatch_bench.cpp -o dispatch_bench
+
+#include <cstdio>
+#include <random>
+
+#define EVENT_IMPLEMENTATION
+#include "event.h"
+
+struct BenchEventA : EventOf<BenchEventA> { static const size_t id; constexpr size_t get_id() override; size_t value = 1; };
+struct BenchEventB : EventOf<BenchEventB> { static const size_t id; constexpr size_t get_id() override; size_t value = 2; };
+struct BenchEventC : EventOf<BenchEventC> { static const size_t id; constexpr size_t get_id() override; size_t value = 3; };
+struct BenchEventD : EventOf<BenchEventD> { static const size_t id; constexpr size_t get_id() override; size_t value = 4; };
+
+EVENT_GEN(BenchEventA)
+EVENT_GEN(BenchEventB)
+EVENT_GEN(BenchEventC)
+EVENT_GEN(BenchEventD)
+
+MAX_EVENT_INIT
+
+struct Counter
+{
+    size_t total = 0;
+
+    void on_a(BenchEventA* event) { total += event->value; }
+    void on_b(BenchEventB* event) { total += event->value; }
+    void on_c(BenchEventC* event) { total += event->value; }
+    void on_d(BenchEventD* event) { total += event->value; }
+};
+
+// The dispatch used before handlers were stored by value, kept here as the baseline
+namespace virtual_dispatch
+{
+    class IEventHandler 
+    { 
+    public: 
+        virtual ~IEventHandler() {}
+        virtual void exec(Event* event) = 0; 
+    }; 
+
+    template <typename T, ValidEvent E> 
+    class EventHandler : public IEventHandler 
+    { 
+    private:
+        T* instance;
+        handler_fun_t<T, E> mem_fun;
+    public:
+        EventHandler(T* instance, handler_fun_t<T, E> mem_fun) : instance(instance), mem_fun(mem_fun) {}
+        void exec(Event* event) override { (instance->*mem_fun)(static_cast<E*>(event)); }
+    };
+
+    struct Processor
+    {
+        std::vector<std::vector<IEventHandler*>> handlers = 
+            std::vector<std::vector<IEventHandler*>>(max_event_types);
+
+        ~Processor() 
+        { 
+            for (auto& group : handlers) for (auto* handler : group) delete handler; 
+        }
+
+        void process(const std::vector<Event*>& events)
+        {
+            for (Event* event : events)
+            {
+                for (auto* handler : handlers[event->get_id()]) handler->exec(event);
+            }
+        }
+    };
+}
+
+std::vector<Event*> make_events(size_t count, size_t types)
+{
+    std::mt19937 rng(7);
+    std::vector<Event*> events;
+    for (size_t i = 0; i < count; i++)
+    {
+        switch (rng() % types)
+        {
+            case 0: events.push_back(new BenchEventA); break;
+            case 1: events.push_back(new BenchEventB); break;
+            case 2: events.push_back(new BenchEventC); break;
+            default: events.push_back(new BenchEventD); break;
+        }
+    }
+    return events;
+}
+
+int main()
+{
+    const size_t num_events = 1 << 16;
+    const size_t repeats = 64;
+
+    std::printf("%6s %9s %16s %16s %16s %16s %16s\n", "types", "handlers", "virtual h/s", "runtime h/s", "static h/s", 
+        "closed h/s", "inlined h/s");
+    for (size_t types : { 1, 4 })
+    {
+        for (size_t handlers_per_type : { 1, 4, 16 })
+        {
+            auto events = make_events(num_events, types);
+            // The reference held here keeps the events alive between rounds
+            EventBatch* batch = EventBatch::create(num_events);
+            std::copy(events.begin(), events.end(), batch->data());
+            std::vector<Counter> counters(handlers_per_type);
+
+            virtual_dispatch::Processor old_processor;
+            moodycamel::ConcurrentQueue<std::pair<Event*, size_t>> queue;
+            EventArenaPool arena_pool;
+            EventProcessor runtime_processor(moodycamel::ProducerToken(queue), &arena_pool);
+            EventProcessor static_processor(moodycamel::ProducerToken(queue), &arena_pool);
+            StaticEventProcessor<BenchEventA, BenchEventB, BenchEventC, BenchEventD> closed_processor;
+
+            for (auto& counter : counters)
+            {
+                using namespace virtual_dispatch;
+                old_processor.handlers[BenchEventA::id].push_back(new EventHandler<Counter, BenchEventA>(&counter, &Counter::on_a));
+                old_processor.handlers[BenchEventB::id].push_back(new EventHandler<Counter, BenchEventB>(&counter, &Counter::on_b));
+                old_processor.handlers[BenchEventC::id].push_back(new EventHandler<Counter, BenchEventC>(&counter, &Counter::on_c));
+                old_processor.handlers[BenchEventD::id].push_back(new EventHandler<Counter, BenchEventD>(&counter, &Counter::on_d));
+
+                runtime_processor.subscribe<Counter, BenchEventA>(&counter, &Counter::on_a);
+                runtime_processor.subscribe<Counter, BenchEventB>(&counter, &Counter::on_b);
+                runtime_processor.subscribe<Counter, BenchEventC>(&counter, &Counter::on_c);
+                runtime_processor.subscribe<Counter, BenchEventD>(&counter, &Counter::on_d);
+
+                static_processor.subscribe<&Counter::on_a>(&counter);
+                static_processor.subscribe<&Counter::on_b>(&counter);
+                static_processor.subscribe<&Counter::on_c>(&counter);
+                static_processor.subscribe<&Counter::on_d>(&counter);
+
+                closed_processor.subscribe<&Counter::on_a>(&counter);
+                closed_processor.subscribe<&Counter::on_b>(&counter);
+                closed_processor.subscribe<&Counter::on_c>(&counter);
+                closed_processor.subscribe<&Counter::on_d>(&counter);
+            }
+
+            double calls = (double) num_events * handlers_per_type * repeats;
+
+            Timer timer;
+            for (size_t r = 0; r < repeats; r++) old_processor.process(events);
+            double old_rate = calls / (timer.get_time_ns().count() * 1e-9);
+
+            timer.reset_timer();
+            for (size_t r = 0; r < repeats; r++)
+            {
+                batch->acquire();
+                runtime_processor.add_events(batch);
+                runtime_processor.process_events();
+            }
+            double runtime_rate = calls / (timer.get_time_ns().count() * 1e-9);
+
+            timer.reset_timer();
+            for (size_t r = 0; r < repeats; r++)
+            {
+                batch->acquire();
+                static_processor.add_events(batch);
+                static_processor.process_events();
+            }
+            double static_rate = calls / (timer.get_time_ns().count() * 1e-9);
+
+            // Events are stored by value, the variants are built once like the batch of the other processors
+            using ClosedProcessor = decltype(closed_processor);
+            std::vector<ClosedProcessor::event_type> closed_events;
+            for (Event* event : events)
+            {
+                size_t id = event->get_type_id();
+                if (id == BenchEventA::id) closed_events.emplace_back(*static_cast<BenchEventA*>(event));
+                else if (id == BenchEventB::id) closed_events.emplace_back(*static_cast<BenchEventB*>(event));
+                else if (id == BenchEventC::id) closed_events.emplace_back(*static_cast<BenchEventC*>(event));
+                else closed_events.emplace_back(*static_cast<BenchEventD*>(event));
+            }
+
+            timer.reset_timer();
+            for (size_t r = 0; r < repeats; r++)
+            {
+                closed_processor.process(closed_events.data(), closed_events.size());
+            }
+            double closed_ns = timer.get_time_ns().count();
+            double closed_rate = calls / (closed_ns * 1e-9);
+
+            // Same processor with the handlers fixed at compile time, one StaticHandlers per counter
+            using CounterHandlers = StaticHandlers<&Counter::on_a, &Counter::on_b, &Counter::on_c, &Counter::on_d>;
+            std::vector<CounterHandlers> inlined_handlers;
+            for (auto& counter : counters)
+            {
+                inlined_handlers.emplace_back(&counter, &counter, &counter, &counter);
+            }
+
+            timer.reset_timer();
+            for (size_t r = 0; r < repeats; r++)
+            {
+                ClosedProcessor::process(closed_events.data(), closed_events.size(), [&inlined_handlers](auto& event) {
+                    for (const auto& handlers : inlined_handlers) handlers(event);
+                });
+            }
+            double inlined_rate = calls / (timer.get_time_ns().count() * 1e-9);
+
+            std::printf("%6zu %9zu %16.3e %16.3e %16.3e %16.3e %16.3e\n", types, handlers_per_type, old_rate, runtime_rate, 
+                static_rate, closed_rate, inlined_rate);
+            batch->release();
+        }
+    }
+}
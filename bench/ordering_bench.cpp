@@ -0,0 +1,76 @@
+// Compares the batch ordering strategies used by MultiEventManager::move_to_processors
+// Build: the ordering_bench target, or g++ -std=c++20 -O2 -pthread -I.. ordering_bench.cpp -o ordering_bench
+
+#include <cstdio>
+#include <random>
+
+#define EVENT_IMPLEMENTATION
+#include "event.h"
+
+MAX_EVENT_INIT
+
+// Builds a batch the way try_dequeue_bulk returns it, runs of each producer's sub queue in order 
+std::vector<std::pair<Event*, size_t>> make_batch(size_t size, size_t producers, size_t base)
+{
+    std::vector<std::vector<std::pair<Event*, size_t>>> runs(producers);
+    std::mt19937_64 rng(size * 31 + producers);
+
+    for (size_t i = 0; i < size; i++)
+    {
+        runs[rng() % producers].emplace_back(nullptr, base + i);
+    }
+
+    std::vector<std::pair<Event*, size_t>> batch;
+    batch.reserve(size);
+    for (auto& run : runs)
+    {
+        batch.insert(batch.end(), run.begin(), run.end());
+    }
+    return batch;
+}
+
+template <typename F>
+double time_per_event_ns(const std::vector<std::pair<Event*, size_t>>& batch, size_t repeats, F&& fun)
+{
+    Timer timer;
+    for (size_t r = 0; r < repeats; r++)
+    {
+        auto copy = batch;
+        fun(copy);
+    }
+    return (double) timer.get_time_ns().count() / (repeats * batch.size());
+}
+
+int main()
+{
+    ThreadPool pool;
+    const size_t producers = 16;
+
+    std::printf("%10s %14s %14s %14s %14s\n", "batch", "scatter ns/ev", "radix ns/ev", "compact ns/ev", 
+        "mt radix ns/ev");
+    for (size_t size = 1 << 8; size <= 1 << 20; size <<= 2)
+    {
+        auto batch = make_batch(size, producers, 1'000'000'007);
+        size_t repeats = std::max<size_t>(1, (1 << 24) / size);
+
+        std::vector<Event*> output(size);
+
+        double scatter = time_per_event_ns(batch, repeats, [&](auto& input) {
+            sequence_scatter(input, output.data());
+        });
+
+        double radix = time_per_event_ns(batch, repeats, [&](auto& input) {
+            multithreaded_radix<Event*, 32>(input, output.data(), pool, SIZE_MAX);
+        });
+
+        double compact = time_per_event_ns(batch, repeats, [&](auto& input) {
+            multithreaded_radix<Event*, 32>(input, output.data(), pool, SIZE_MAX, true);
+        });
+
+        double mt_radix = time_per_event_ns(batch, repeats, [&](auto& input) {
+            multithreaded_radix<Event*, 32>(input, output.data(), pool, 0);
+        });
+
+        std::printf("%10zu %14.2f %14.2f %14.2f %14.2f\n", size, scatter, radix, compact, mt_radix);
+    }
+}
@@ -0,0 +1,908 @@
+// End to end workloads of MultiEventManager, results are written as JSON so runs can be compared
+// Build: the pipeline_bench target, run as pipeline_bench [output.json]
+
+#include <cstdio>
+#include <random>
+#include <string>
+
+#define EVENT_IMPLEMENTATION
+#include "event.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PIPELINE_BENCH_POSIX
+#include "event_journal.h"
+#include "event_shm.h"
+
+#include <sys/wait.h>
+#endif
+
+struct PipelineEventA : EventOf<PipelineEventA> { static const size_t id; constexpr size_t get_id() override; uint64_t stamp = 0; };
+struct PipelineEventB : EventOf<PipelineEventB> { static const size_t id; constexpr size_t get_id() override; uint64_t stamp = 0; };
+struct PipelineEventC : EventOf<PipelineEventC> { static const size_t id; constexpr size_t get_id() override; uint64_t stamp = 0; };
+struct PipelineEventD : EventOf<PipelineEventD> { static const size_t id; constexpr size_t get_id() override; uint64_t stamp = 0; };
+
+EVENT_GEN(PipelineEventA)
+EVENT_GEN(PipelineEventB)
+EVENT_GEN(PipelineEventC)
+EVENT_GEN(PipelineEventD)
+
+// Same 32 byte payload as a value event and as an Event*
+struct PipelineValue { static const size_t id; constexpr size_t get_id(); uint64_t stamp = 0; uint64_t payload[3] = {}; };
+struct PipelinePointer : EventOf<PipelinePointer> { static const size_t id; constexpr size_t get_id() override; uint64_t stamp = 0; uint64_t payload[3] = {}; };
+
+EVENT_GEN(PipelineValue)
+EVENT_GEN(PipelinePointer)
+
+MAX_EVENT_INIT
+
+using BenchClock = std::chrono::steady_clock;
+
+inline uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now().time_since_epoch()).count();
+}
+
+// One JSON object per measurement, every field is a number
+struct Result
+{
+    std::string name;
+    std::vector<std::pair<std::string, double>> fields;
+};
+
+std::vector<Result> results;
+
+void report(const std::string& name, std::vector<std::pair<std::string, double>> fields)
+{
+    std::printf("%-10s", name.c_str());
+    for (auto& [key, value] : fields)
+    {
+        std::printf(" %s=%.4g", key.c_str(), value);
+    }
+    std::printf("\n");
+    results.push_back({ name, std::move(fields) });
+}
+
+void write_json(std::FILE* file)
+{
+    std::fprintf(file, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        std::fprintf(file, "    { \"name\": \"%s\"", results[i].name.c_str());
+        for (auto& [key, value] : results[i].fields)
+        {
+            std::fprintf(file, ", \"%s\": %.17g", key.c_str(), value);
+        }
+        std::fprintf(file, " }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(file, "  ]\n}\n");
+}
+
+struct Counter
+{
+    size_t total = 0;
+
+    void on_a(PipelineEventA*) { total++; }
+    void on_b(PipelineEventB*) { total++; }
+    void on_c(PipelineEventC*) { total++; }
+    void on_d(PipelineEventD*) { total++; }
+};
+
+template <typename E>
+void submit_one(MultiEventManager& manager, size_t processor_id)
+{
+    E* event = manager.emplace<E>(processor_id);
+    event->stamp = now_ns();
+    manager.submit(processor_id, event);
+}
+
+// Moves and processes everything submitted so far so the arenas can be reused
+void drain(MultiEventManager& manager)
+{
+    manager.move_to_processors();
+    manager.process_all();
+}
+
+// Events per second submitted by producers threads at once, each through its own processor
+void bench_submit()
+{
+    const size_t events_per_producer = 1 << 16;
+
+    for (size_t producers = 1; producers <= 64; producers *= 2)
+    {
+        MultiEventManager manager;
+        std::vector<size_t> ids;
+        for (size_t i = 0; i < producers; i++) ids.push_back(manager.get_processor());
+
+        std::atomic<size_t> ready = 0;
+        std::atomic<bool> start = false;
+        std::vector<std::thread> threads;
+        for (size_t id : ids)
+        {
+            threads.emplace_back([&, id] {
+                ready++;
+                while (!start.load()) std::this_thread::yield();
+                for (size_t i = 0; i < events_per_producer; i++) submit_one<PipelineEventA>(manager, id);
+            });
+        }
+        while (ready.load() != producers) std::this_thread::yield();
+
+        Timer<BenchClock> timer;
+        start = true;
+        for (auto& thread : threads) thread.join();
+        double seconds = timer.get_time_ns().count() * 1e-9;
+
+        drain(manager);
+        report("submit", { { "producers", producers },
+            { "events_per_sec", producers * events_per_producer / seconds } });
+    }
+}
+
+// Cost of one move_to_processors call per event, events come from 16 producers so batches are interleaved
+void bench_move()
+{
+    const size_t producers = 16;
+    const size_t num_processors = 4;
+
+    for (size_t size = 1 << 8; size <= 1 << 20; size <<= 2)
+    {
+        MultiEventManager manager;
+        for (size_t i = 0; i < std::max(producers, num_processors); i++) manager.get_processor();
+
+        size_t repeats = std::max<size_t>(1, (1 << 22) / size);
+        uint64_t total_ns = 0;
+        for (size_t r = 0; r < repeats; r++)
+        {
+            for (size_t i = 0; i < size; i++) submit_one<PipelineEventA>(manager, i % producers);
+
+            Timer<BenchClock> timer;
+            manager.move_to_processors();
+            total_ns += timer.get_time_ns().count();
+
+            manager.process_all();
+        }
+
+        report("move", { { "batch", size }, { "processors", num_processors },
+            { "ns_per_event", (double) total_ns / (repeats * size) } });
+    }
+}
+
+// Sorting a dequeued batch with multithreaded_radix against std::sort on the sequence numbers
+void bench_sort()
+{
+    ThreadPool pool;
+    const size_t producers = 16;
+
+    for (size_t size = 1 << 10; size <= 1 << 20; size <<= 2)
+    {
+        std::vector<std::vector<std::pair<Event*, size_t>>> runs(producers);
+        std::mt19937_64 rng(size);
+        for (size_t i = 0; i < size; i++) runs[rng() % producers].emplace_back(nullptr, 1'000'000'007 + i);
+
+        std::vector<std::pair<Event*, size_t>> batch;
+        for (auto& run : runs) batch.insert(batch.end(), run.begin(), run.end());
+
+        std::vector<Event*> output(size);
+        size_t repeats = std::max<size_t>(1, (1 << 22) / size);
+
+        auto time_ns = [&](auto&& sort) {
+            uint64_t total_ns = 0;
+            for (size_t r = 0; r < repeats; r++)
+            {
+                auto copy = batch;
+                Timer<BenchClock> timer;
+                sort(copy);
+                total_ns += timer.get_time_ns().count();
+            }
+            return (double) total_ns / (repeats * size);
+        };
+
+        double radix = time_ns([&](auto& input) {
+            multithreaded_radix<Event*, 32>(input, output.data(), pool, SIZE_MAX);
+        });
+        double mt_radix = time_ns([&](auto& input) {
+            multithreaded_radix<Event*, 32>(input, output.data(), pool, 0);
+        });
+        double std_sort = time_ns([&](auto& input) {
+            std::sort(input.begin(), input.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+            for (size_t i = 0; i < input.size(); i++) output[i] = input[i].first;
+        });
+
+        report("sort", { { "batch", size }, { "radix_ns_per_event", radix },
+            { "mt_radix_ns_per_event", mt_radix }, { "std_sort_ns_per_event", std_sort } });
+    }
+}
+
+// Handler calls per second of one processor for a mix of event types and handlers per type
+void bench_dispatch()
+{
+    const size_t num_events = 1 << 16;
+    const size_t repeats = 32;
+
+    for (size_t types : { 1, 2, 4 })
+    {
+        for (size_t handlers_per_type : { 1, 4, 16 })
+        {
+            MultiEventManager manager;
+            size_t id = manager.get_processor();
+
+            std::vector<Counter> counters(handlers_per_type);
+            for (auto& counter : counters)
+            {
+                manager.subscribe<&Counter::on_a>(id, &counter);
+                manager.subscribe<&Counter::on_b>(id, &counter);
+                manager.subscribe<&Counter::on_c>(id, &counter);
+                manager.subscribe<&Counter::on_d>(id, &counter);
+            }
+
+            uint64_t total_ns = 0;
+            for (size_t r = 0; r < repeats; r++)
+            {
+                for (size_t i = 0; i < num_events; i++)
+                {
+                    switch (i % types)
+                    {
+                        case 0: submit_one<PipelineEventA>(manager, id); break;
+                        case 1: submit_one<PipelineEventB>(manager, id); break;
+                        case 2: submit_one<PipelineEventC>(manager, id); break;
+                        default: submit_one<PipelineEventD>(manager, id); break;
+                    }
+                }
+                manager.move_to_processors();
+
+                Timer<BenchClock> timer;
+                manager.process_events(id);
+                total_ns += timer.get_time_ns().count();
+            }
+
+            double calls = (double) num_events * handlers_per_type * repeats;
+            report("dispatch", { { "types", types }, { "handlers_per_type", handlers_per_type },
+                { "handlers_per_sec", calls / (total_ns * 1e-9) } });
+        }
+    }
+}
+
+struct PayloadSum
+{
+    uint64_t total = 0;
+    void on_value(PipelineValue* event) { total += event->payload[0]; }
+    void on_pointer(PipelinePointer* event) { total += event->payload[0]; }
+};
+
+// Dispatch of 32 byte events copied into the batch with submit_value against the same events as Event*
+void bench_value_dispatch()
+{
+    const size_t num_events = 1 << 16;
+    const size_t repeats = 32;
+
+    for (bool values : { false, true })
+    {
+        MultiEventManager manager;
+        size_t id = manager.get_processor();
+        PayloadSum sum;
+        manager.subscribe<&PayloadSum::on_value>(id, &sum);
+        manager.subscribe<&PayloadSum::on_pointer>(id, &sum);
+
+        uint64_t move_ns = 0, dispatch_ns = 0;
+        for (size_t r = 0; r < repeats; r++)
+        {
+            for (size_t i = 0; i < num_events; i++)
+            {
+                if (values)
+                {
+                    PipelineValue event;
+                    event.payload[0] = i;
+                    manager.submit_value(id, event);
+                }
+                else
+                {
+                    auto* event = manager.emplace<PipelinePointer>(id);
+                    event->payload[0] = i;
+                    manager.submit(id, event);
+                }
+            }
+
+            Timer<BenchClock> timer;
+            manager.move_to_processors();
+            move_ns += timer.get_time_ns().count();
+
+            timer.reset_timer();
+            manager.process_events(id);
+            dispatch_ns += timer.get_time_ns().count();
+        }
+
+        double events = (double) num_events * repeats;
+        report("values", { { "value_events", values }, 
+            { "move_ns_per_event", move_ns / events }, { "dispatch_ns_per_event", dispatch_ns / events } });
+    }
+}
+
+// Many processors that each handle one of the four types, broadcast against route_by_subscription
+void bench_routing()
+{
+    const size_t num_events = 1 << 16;
+    const size_t num_processors = 32;
+    const size_t repeats = 8;
+
+    for (bool route : { false, true })
+    {
+        EventManagerOptions options;
+        options.route_by_subscription = route;
+        MultiEventManager manager(options);
+
+        std::vector<Counter> counters(num_processors);
+        for (size_t p = 0; p < num_processors; p++)
+        {
+            size_t id = manager.get_processor();
+            switch (p % 4)
+            {
+                case 0: manager.subscribe<&Counter::on_a>(id, &counters[p]); break;
+                case 1: manager.subscribe<&Counter::on_b>(id, &counters[p]); break;
+                case 2: manager.subscribe<&Counter::on_c>(id, &counters[p]); break;
+                default: manager.subscribe<&Counter::on_d>(id, &counters[p]); break;
+            }
+        }
+
+        uint64_t move_ns = 0, dispatch_ns = 0;
+        for (size_t r = 0; r < repeats; r++)
+        {
+            // Only A and B, so half of the processors have nothing to do
+            for (size_t i = 0; i < num_events; i++)
+            {
+                if (i % 2) submit_one<PipelineEventA>(manager, 0);
+                else submit_one<PipelineEventB>(manager, 0);
+            }
+
+            Timer<BenchClock> timer;
+            manager.move_to_processors();
+            move_ns += timer.get_time_ns().count();
+
+            timer.reset_timer();
+            manager.process_all();
+            dispatch_ns += timer.get_time_ns().count();
+        }
+
+        double events = (double) num_events * repeats;
+        report("routing", { { "route_by_subscription", route }, { "processors", num_processors },
+            { "move_ns_per_event", move_ns / events }, { "dispatch_ns_per_event", dispatch_ns / events } });
+    }
+}
+
+struct KeyedCounter
+{
+    size_t slot = 0, slots = 1, total = 0;
+    // Without partitioning every processor sees every event and keeps its own keys
+    bool filter = false;
+    void on_a(PipelineEventA* event) { if (!filter || event->stamp % slots == slot) total++; }
+};
+
+// One event type spread over processors by key, against every processor seeing every event and skipping
+// the keys it does not own
+void bench_partition()
+{
+    const size_t num_events = 1 << 16;
+    const size_t num_processors = 4;
+    const size_t repeats = 8;
+
+    for (bool partitioned : { false, true })
+    {
+        EventManagerOptions options;
+        options.worker_threads = num_processors;
+        MultiEventManager manager(options);
+
+        std::vector<KeyedCounter> counters(num_processors);
+        std::vector<size_t> ids;
+        for (size_t p = 0; p < num_processors; p++)
+        {
+            ids.push_back(manager.get_processor());
+            counters[p] = { p, num_processors, 0, !partitioned };
+            manager.subscribe<&KeyedCounter::on_a>(ids.back(), &counters[p]);
+        }
+        if (partitioned) manager.partition<PipelineEventA>(ids, [](const PipelineEventA& event) { return event.stamp; });
+
+        uint64_t move_ns = 0, dispatch_ns = 0;
+        for (size_t r = 0; r < repeats; r++)
+        {
+            for (size_t i = 0; i < num_events; i++)
+            {
+                submit_one<PipelineEventA>(manager, 0);
+            }
+
+            Timer<BenchClock> timer;
+            manager.move_to_processors();
+            move_ns += timer.get_time_ns().count();
+
+            timer.reset_timer();
+            manager.process_all();
+            dispatch_ns += timer.get_time_ns().count();
+        }
+
+        double events = (double) num_events * repeats;
+        report("partition", { { "partitioned", partitioned }, { "processors", num_processors },
+            { "move_ns_per_event", move_ns / events }, { "dispatch_ns_per_event", dispatch_ns / events } });
+    }
+}
+
+// Checks the order the handlers see when one thread alternates Event* and value submits while another
+// moves, the two kinds go through different queues and have to be cut at the same sequence number
+struct OrderChecker
+{
+    uint64_t last = 0, seen = 0, out_of_order = 0;
+
+    void check(uint64_t stamp)
+    {
+        if (seen++ && stamp <= last) out_of_order++;
+        last = stamp;
+    }
+    void on_pointer(PipelinePointer* event) { check(event->stamp); }
+    void on_value(PipelineValue* event) { check(event->stamp); }
+};
+
+void bench_mixed_order()
+{
+    const size_t num_events = 1 << 21;
+
+    MultiEventManager manager;
+    size_t id = manager.get_processor(), producer_id = manager.get_processor();
+    OrderChecker checker;
+    manager.subscribe<&OrderChecker::on_pointer>(id, &checker);
+    manager.subscribe<&OrderChecker::on_value>(id, &checker);
+
+    std::atomic<bool> done = false;
+    Timer<BenchClock> timer;
+    std::thread producer([&] {
+        for (size_t i = 1; i <= num_events; i++)
+        {
+            if (i % 2)
+            {
+                auto* event = manager.emplace<PipelinePointer>(producer_id);
+                event->stamp = i;
+                manager.submit(producer_id, event);
+            }
+            else
+            {
+                PipelineValue event;
+                event.stamp = i;
+                manager.submit_value(producer_id, event);
+            }
+        }
+        done = true;
+    });
+
+    while (!done.load() || checker.seen < num_events)
+    {
+        manager.move_to_processors();
+        manager.process_events(id);
+    }
+    producer.join();
+
+    report("mixed", { { "events", (double) checker.seen }, { "out_of_order", (double) checker.out_of_order },
+        { "ns_per_event", (double) timer.get_time_ns().count() / num_events } });
+}
+
+// Bursts of updates for a few keys, every update dispatched against only the last one per key with conflate
+void bench_conflate()
+{
+    const size_t num_events = 1 << 16;
+    const size_t num_keys = 64;
+    const size_t repeats = 16;
+
+    for (bool conflated : { false, true })
+    {
+        MultiEventManager manager;
+        size_t id = manager.get_processor();
+        PayloadSum sum;
+        manager.subscribe<&PayloadSum::on_value>(id, &sum);
+        if (conflated) manager.conflate<PipelineValue>([](const PipelineValue& event) { return event.payload[1]; });
+
+        uint64_t move_ns = 0, dispatch_ns = 0;
+        for (size_t r = 0; r < repeats; r++)
+        {
+            for (size_t i = 0; i < num_events; i++)
+            {
+                PipelineValue event;
+                event.payload[0] = 1;
+                event.payload[1] = i % num_keys;
+                manager.submit_value(id, event);
+            }
+
+            Timer<BenchClock> timer;
+            manager.move_to_processors();
+            move_ns += timer.get_time_ns().count();
+
+            timer.reset_timer();
+            manager.process_events(id);
+            dispatch_ns += timer.get_time_ns().count();
+        }
+
+        double events = (double) num_events * repeats;
+        report("conflate", { { "conflated", conflated }, { "keys", num_keys }, 
+            { "move_ns_per_event", move_ns / events }, { "dispatch_ns_per_event", dispatch_ns / events } });
+    }
+}
+
+// Every A starts a workflow that waits for the next B, against plain handlers on both
+struct Workflow
+{
+    MultiEventManager* manager;
+    size_t processor_id;
+    size_t total = 0, paired = 0;
+
+    EventTask on_a(PipelineEventA* a)
+    {
+        uint64_t stamp = a->stamp;
+        PipelineEventB* b = co_await manager->next<PipelineEventB>(processor_id);
+        total += 2;
+        if (b->stamp == stamp + 1) paired++;
+    }
+};
+
+// An I/O thread completing what a coroutine waits for, hands it back to its processor with post
+struct FakeIo
+{
+    MultiEventManager* manager;
+    size_t processor_id;
+    std::atomic<void*> pending = nullptr;
+
+    struct Completion
+    {
+        FakeIo* io;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { io->pending.store(handle.address(), std::memory_order_release); }
+        void await_resume() const noexcept {}
+    };
+    Completion complete() { return { this }; }
+
+    void run(const std::atomic<bool>& done)
+    {
+        while (!done.load(std::memory_order_relaxed))
+        {
+            void* handle = pending.exchange(nullptr, std::memory_order_acquire);
+            if (handle) manager->post(processor_id, std::coroutine_handle<>::from_address(handle));
+        }
+    }
+};
+
+// Hops between two processors with resume_on, or between a processor and an I/O thread with post
+EventTask hop(MultiEventManager& manager, size_t first, size_t second, FakeIo* io, size_t hops, std::atomic<bool>& done)
+{
+    co_await manager.resume_on(first);
+    for (size_t i = 0; i < hops; i++)
+    {
+        if (io) co_await io->complete();
+        else co_await manager.resume_on(i % 2 ? first : second);
+    }
+    done.store(true);
+}
+
+// Workflows resumed by next against plain handlers, then the cost of a hop with resume_on and post
+void bench_coroutine()
+{
+    const size_t num_events = 1 << 16;
+    const size_t repeats = 8;
+
+    for (bool workflow : { false, true })
+    {
+        MultiEventManager manager;
+        size_t id = manager.get_processor();
+        Counter counter;
+        Workflow flow { &manager, id };
+        if (workflow)
+        {
+            manager.subscribe<&Workflow::on_a>(id, &flow);
+        }
+        else
+        {
+            manager.subscribe<&Counter::on_a>(id, &counter);
+            manager.subscribe<&Counter::on_b>(id, &counter);
+        }
+
+        uint64_t dispatch_ns = 0;
+        for (size_t r = 0; r < repeats; r++)
+        {
+            for (size_t i = 0; i < num_events; i++)
+            {
+                if (i % 2 == 0) 
+                {
+                    auto* a = manager.emplace<PipelineEventA>(id);
+                    a->stamp = i;
+                    manager.submit(id, a);
+                }
+                else
+                {
+                    auto* b = manager.emplace<PipelineEventB>(id);
+                    b->stamp = i;
+                    manager.submit(id, b);
+                }
+            }
+            manager.move_to_processors();
+
+            Timer<BenchClock> timer;
+            manager.process_events(id);
+            dispatch_ns += timer.get_time_ns().count();
+        }
+
+        double events = (double) num_events * repeats;
+        report("coroutine", { { "workflow", workflow }, { "handled", (double) (counter.total + flow.total) / events },
+            { "paired", workflow ? (double) flow.paired * 2 / events : 1.0 }, { "dispatch_ns_per_event", dispatch_ns / events } });
+    }
+
+    const size_t hops = 1 << 16;
+    for (bool post : { false, true })
+    {
+        MultiEventManager manager;
+        size_t first = manager.get_processor(), second = manager.get_processor();
+        FakeIo io { &manager, first };
+
+        std::atomic<bool> done = false;
+        auto pump = [&](size_t id) {
+            while (!done.load()) manager.wait_and_process(id, std::chrono::milliseconds(1));
+        };
+        std::thread first_thread(pump, first);
+        std::thread second_thread;
+        if (post) second_thread = std::thread([&] { io.run(done); });
+        else second_thread = std::thread(pump, second);
+
+        Timer<BenchClock> timer;
+        hop(manager, first, second, post ? &io : nullptr, hops, done);
+        first_thread.join();
+        second_thread.join();
+
+        report("hop", { { "post", post }, { "ns_per_hop", (double) timer.get_time_ns().count() / hops } });
+    }
+}
+
+#ifdef PIPELINE_BENCH_POSIX
+// Moving value events with a journal attached, then replaying the journal into a fresh manager
+void bench_journal()
+{
+    const size_t num_events = 1 << 16;
+    const size_t repeats = 16;
+
+    auto directory = std::filesystem::temp_directory_path() / "pipeline_bench_journal";
+    std::filesystem::remove_all(directory);
+
+    uint64_t plain_ns = 0, journal_ns = 0;
+    for (bool journaled : { false, true })
+    {
+        EventJournal journal(directory);
+        EventManagerOptions options;
+        if (journaled) options.journal = &journal;
+        MultiEventManager manager(options);
+        size_t id = manager.get_processor();
+
+        for (size_t r = 0; r < repeats; r++)
+        {
+            for (size_t i = 0; i < num_events; i++)
+            {
+                PipelineValue event;
+                event.payload[0] = i;
+                manager.submit_value(id, event);
+            }
+
+            Timer<BenchClock> timer;
+            manager.move_to_processors();
+            (journaled ? journal_ns : plain_ns) += timer.get_time_ns().count();
+            manager.process_events(id);
+        }
+    }
+
+    MultiEventManager manager;
+    size_t id = manager.get_processor();
+    PayloadSum sum;
+    manager.subscribe<&PayloadSum::on_value>(id, &sum);
+
+    Timer<BenchClock> timer;
+    EventJournalReader reader(directory);
+    reader.replay(manager);
+    manager.process_events(id);
+    uint64_t replay_ns = timer.get_time_ns().count();
+
+    std::filesystem::remove_all(directory);
+
+    double events = (double) num_events * repeats;
+    report("journal", { { "move_ns_per_event", plain_ns / events }, { "journaled_move_ns_per_event", journal_ns / events },
+        { "replay_ns_per_event", replay_ns / events } });
+}
+
+// Value events from producer threads through the shm ring against submit_value, producer to handler, 
+// then from forked producer processes through the ring while the main thread also moves its own events
+void bench_shm()
+{
+    const size_t num_events = 1 << 20;
+
+    for (size_t producers : { 1, 4 })
+    {
+        for (bool shm : { false, true })
+        {
+            MultiEventManager manager;
+            size_t id = manager.get_processor();
+            PayloadSum sum;
+            manager.subscribe<&PayloadSum::on_value>(id, &sum);
+
+            std::string name = "/pipeline_bench_" + std::to_string(getpid());
+            ShmEventConsumer consumer(name, 1 << 16);
+            std::vector<size_t> producer_ids;
+            for (size_t p = 0; p < producers; p++)
+            {
+                producer_ids.push_back(manager.get_processor());
+            }
+
+            Timer<BenchClock> timer;
+            std::vector<std::thread> threads;
+            for (size_t p = 0; p < producers; p++)
+            {
+                threads.emplace_back([&, p] {
+                    PipelineValue event;
+                    event.payload[0] = 1;
+                    if (shm)
+                    {
+                        ShmEventProducer producer(name);
+                        for (size_t i = p; i < num_events; i += producers) producer.submit(event);
+                    }
+                    else
+                    {
+                        for (size_t i = p; i < num_events; i += producers) manager.submit_value(producer_ids[p], event);
+                    }
+                });
+            }
+
+            while (sum.total < num_events)
+            {
+                if (shm) consumer.move_to(manager);
+                else manager.move_to_processors();
+                manager.process_events(id);
+            }
+            uint64_t total_ns = timer.get_time_ns().count();
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            report("shm", { { "producers", producers }, { "shm", shm }, { "processes", 0 },
+                { "ns_per_event", (double) total_ns / num_events } });
+        }
+    }
+
+    // Children only touch the ring, so a fork of this threaded process is fine
+    for (size_t producers : { 1, 4 })
+    {
+        MultiEventManager manager;
+        size_t id = manager.get_processor();
+        PayloadSum sum;
+        manager.subscribe<&PayloadSum::on_value>(id, &sum);
+
+        std::string name = "/pipeline_bench_" + std::to_string(getpid());
+        ShmEventConsumer consumer(name, 1 << 16);
+
+        // Children do not inherit unwritten report lines
+        std::fflush(stdout);
+        Timer<BenchClock> timer;
+        std::vector<pid_t> children;
+        for (size_t p = 0; p < producers; p++)
+        {
+            pid_t child = fork();
+            if (child == 0)
+            {
+                ShmEventProducer producer(name);
+                PipelineValue event;
+                event.payload[0] = 1;
+                for (size_t i = p; i < num_events; i += producers) producer.submit(event);
+                _exit(0);
+            }
+            children.push_back(child);
+        }
+
+        // The ring's batches are handed out on another thread while this one moves its own events
+        std::atomic<bool> done = false;
+        std::thread mover([&] {
+            while (!done.load(std::memory_order_relaxed)) consumer.move_to(manager);
+        });
+
+        size_t local_id = manager.get_processor();
+        PipelineValue local;
+        local.payload[0] = 1;
+        size_t local_events = 0;
+        while (sum.total < num_events + local_events)
+        {
+            if (local_events < num_events / 16)
+            {
+                manager.submit_value(local_id, local);
+                local_events++;
+            }
+            manager.move_to_processors();
+            manager.process_events(id);
+        }
+        uint64_t total_ns = timer.get_time_ns().count();
+        done = true;
+        mover.join();
+        for (pid_t child : children)
+        {
+            waitpid(child, nullptr, 0);
+        }
+
+        report("shm", { { "producers", producers }, { "shm", 1 }, { "processes", 1 },
+            { "ns_per_event", (double) total_ns / num_events } });
+    }
+}
+#endif
+
+struct LatencyRecorder
+{
+    std::vector<uint64_t> samples;
+    void on_a(PipelineEventA* event) { samples.push_back(now_ns() - event->stamp); }
+};
+
+// Submit to handler latency with the pump moving batches and a parked consumer, at a steady submit rate
+void bench_latency()
+{
+    const size_t num_events = 1 << 14;
+
+    for (auto interval : { std::chrono::microseconds(2), std::chrono::microseconds(20) })
+    {
+        EventManagerOptions options;
+        options.pump = true;
+        MultiEventManager manager(options);
+        size_t id = manager.get_processor();
+
+        LatencyRecorder recorder;
+        recorder.samples.reserve(num_events);
+        manager.subscribe<&LatencyRecorder::on_a>(id, &recorder);
+
+        std::atomic<bool> done = false;
+        std::thread consumer([&] {
+            while (!done.load() || recorder.samples.size() < num_events)
+            {
+                manager.wait_and_process(id, std::chrono::milliseconds(10));
+            }
+        });
+
+        auto next = BenchClock::now();
+        for (size_t i = 0; i < num_events; i++)
+        {
+            while (BenchClock::now() < next);
+            next += interval;
+            submit_one<PipelineEventA>(manager, id);
+        }
+        done = true;
+        consumer.join();
+
+        auto& samples = recorder.samples;
+        std::sort(samples.begin(), samples.end());
+        auto percentile = [&](double p) { return (double) samples[std::min(samples.size() - 1, (size_t) (p * samples.size()))]; };
+
+        report("latency", { { "interval_us", (double) interval.count() },
+            { "p50_ns", percentile(0.5) }, { "p90_ns", percentile(0.9) },
+            { "p99_ns", percentile(0.99) }, { "p999_ns", percentile(0.999) } });
+    }
+}
+
+int main(int argc, char** argv)
+{
+    bench_submit();
+    bench_move();
+    bench_sort();
+    bench_dispatch();
+    bench_value_dispatch();
+    bench_mixed_order();
+    bench_routing();
+    bench_partition();
+    bench_conflate();
+    bench_coroutine();
+#ifdef PIPELINE_BENCH_POSIX
+    bench_journal();
+    bench_shm();
+#endif
+    bench_latency();
+
+    std::FILE* file = argc > 1 ? std::fopen(argv[1], "w") : nullptr;
+    if (argc > 1 && !file)
+    {
+        std::perror(argv[1]);
+        return 1;
+    }
+    if (file)
+    {
+        write_json(file);
+        std::fclose(file);
+    }
+}
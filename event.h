@@ -5,17 +5,41 @@
 
 // std
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <bit>
+#include <cassert>
+#include <chrono>
 #include <cmath>
 #include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <functional>
+#include <iterator>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
 #include <type_traits>
+#include <unordered_set>
+#include <variant>
 #include <vector>
 
+// platform
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 template <typename T>
 concept Clock = std::same_as<T, std::chrono::high_resolution_clock> || std::same_as<T, std::chrono::steady_clock> || std::same_as<T, std::chrono::system_clock>;
 
@@ -32,6 +56,37 @@ public:
     std::chrono::nanoseconds get_time_ns() const { return std::chrono::duration_cast<std::chrono::nanoseconds>(T::now() - start); }
 };
 
+#ifdef EVENT_STATS
+// Clock submit timestamps and latencies are measured on
+inline uint64_t stats_now_ns() 
+{ 
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count(); 
+}
+#endif
+
+#if defined(EVENT_STATS) || defined(EVENT_PROFILE_HANDLERS)
+// Counter written by a single thread, readers may see a slightly stale value but writers never contend
+class StatCounter
+{
+private:
+    std::atomic<uint64_t> value = 0;
+public:
+    inline void add(uint64_t n) 
+    { 
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); 
+    }
+    inline void set(uint64_t n) { value.store(n, std::memory_order_relaxed); }
+    inline uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define EVENT_PREFETCH(x) __builtin_prefetch(x)
+#else
+#define EVENT_PREFETCH(x)
+#endif
+
 #ifdef USE_X86INTRINSICS
 #include <intrin.h>
 #pragma intrinsic(_BitScanForward64)
@@ -88,465 +143,3748 @@ inline int bit_scan_rv(uint64_t x) {
 }
 #endif
 
-class Event
+// Fixed set of worker threads that stay alive between jobs so callers running at frame/tick rate 
+// do not pay for thread creation and teardown every time they fan work out
+// Each thread starts on its own slice of a job and steals half of another thread's remaining slice once it is done,
+// so one slow index does not hold up the rest
+class ThreadPool
 {
-public:
-    virtual ~Event() {}
-    virtual constexpr size_t get_id() = 0;
-};
+private:
+    // Remaining indices [begin, end) of one thread packed as (begin << 32) | end, owners take from the front 
+    // and thieves from the back
+    struct alignas(64) Range
+    {
+        std::atomic<uint64_t> range = 0;
+    };
 
-template <typename T> 
-concept EventDerived = std::is_base_of_v<Event, T>;
+    std::vector<std::thread> workers;
+    std::unique_ptr<Range[]> ranges;
 
-template <typename T>
-concept HasId = requires(T) 
-{
-    { T::id };
-};
+    std::mutex job_mutex;
+    std::condition_variable job_start;
+    std::condition_variable job_done;
 
-template <typename T>
-concept ValidEvent = EventDerived<T> && HasId<T>;
+    // The job being run
+    const std::function<void(size_t)>* job = nullptr;
+    size_t busy_workers = 0;
+    size_t generation = 0;
+    bool stopping = false;
 
-template <typename T, ValidEvent E>
-using handler_fun_t = void (T::*)(E*);
+    void worker_loop(size_t self);
 
-template <typename T> 
-class DeletePointerView 
-{
-private:
-    T* pointer;
+    // Runs indices from this thread's range and then from stolen ones until every range is empty
+    void work(size_t self, const std::function<void(size_t)>& fun);
+    bool pop_front(size_t self, size_t& index);
+    bool steal(size_t self);
 public:
-    DeletePointerView(T* input) : pointer(input) {}    
-
-    DeletePointerView() : pointer(nullptr) {}
-    DeletePointerView(const DeletePointerView<T>& other) = delete;
-    DeletePointerView& operator=(const DeletePointerView<T>& other) = delete;
-
-    DeletePointerView(DeletePointerView<T>&& other)
-    {
-        this->pointer = other.pointer; 
-        other.pointer = nullptr;
-    }
+    // The calling thread also works on every job, so this creates threads - 1 workers
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
 
-    DeletePointerView& operator=(DeletePointerView<T>&& other)
-    {
-        this->pointer = other.pointer; 
-        other.pointer = nullptr;
-        return *this;
-    };
+    ThreadPool(const ThreadPool& other) = delete;
+    ThreadPool& operator=(const ThreadPool& other) = delete;
 
-    T* data() const { return pointer; }
+    // Number of threads that work on a job, including the calling thread
+    inline size_t size() const { return workers.size() + 1; }
 
-    ~DeletePointerView()
-    {
-        delete pointer;
-    }
+    // Calls fun(i) for every i in [0, count) and returns once all of them are done 
+    // Nocall: parallel_for
+    void parallel_for(size_t count, const std::function<void(size_t)>& fun);
 };
 
-#define EVENT_GEN(x)
-
 #ifdef EVENT_IMPLEMENTATION
 
-template <unsigned int N>
-struct reader 
-{
-    friend auto counted_flag(reader);
-};
-
-template <unsigned int N>
-struct setter 
-{
-    friend auto counted_flag(reader<N>) {}
-    static constexpr unsigned n = N;
-};
-
-template <
-    auto Tag,
-    unsigned NextVal = 0
->
-consteval auto counter_impl() 
+ThreadPool::ThreadPool(size_t threads)
+    : ranges(new Range[std::max<size_t>(threads, 1)])
 {
-    constexpr bool counted_past_value = requires(reader<NextVal> r) 
+    for (size_t i = 1; i < threads; i++)
     {
-        counted_flag(r);
-    };
+        workers.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+}
 
-    if constexpr (counted_past_value) 
+ThreadPool::~ThreadPool()
+{
     {
-        return counter_impl<Tag, NextVal + 1>();
+        std::unique_lock lock(job_mutex);
+        stopping = true;
     }
-    else 
+    job_start.notify_all();
+
+    for (auto& worker : workers)
     {
-        return setter<NextVal>::n;
+        worker.join();
     }
 }
 
-template <
-    auto Tag = []{},
-    auto Val = counter_impl<Tag>()
->
-constexpr auto counter = Val;
-
-#undef EVENT_GEN
-#define EVENT_GEN(x) const size_t x::id = counter<>;\
-constexpr size_t x::get_id() { return x::id; }\
+void ThreadPool::worker_loop(size_t self)
+{
+    size_t seen_generation = 0;
 
-#endif
+    for (;;)
+    {
+        std::unique_lock lock(job_mutex);
+        job_start.wait(lock, [&]{ return stopping || generation != seen_generation; });
+        if (stopping) return;
 
-extern const size_t max_event_types;
+        seen_generation = generation;
+        auto& fun = *job;
+        lock.unlock();
 
-class IEventHandler 
-{ 
-public: 
-	virtual ~IEventHandler() {}; 
-	virtual void exec(Event* event) = 0; 
-    virtual void* get_handler_ptr() = 0;
-}; 
-
-template <typename T, ValidEvent E> 
-class EventHandler : public IEventHandler 
-{ 
-private:
-    handler_fun_t<T, E> mem_fun;
-    T* instance;
+        work(self, fun);
 
-public:
-	EventHandler(T* instance, handler_fun_t<T, E> mem_fun) 
-        : instance(instance), mem_fun(mem_fun) {}; 
+        lock.lock();
+        if (--busy_workers == 0) job_done.notify_one();
+    }
+}
 
-    ~EventHandler() override {}
+bool ThreadPool::pop_front(size_t self, size_t& index)
+{
+    auto& range = ranges[self].range;
+    uint64_t current = range.load(std::memory_order_relaxed);
 
-    void exec(Event* event) override
+    for (;;)
     {
-        (instance->*mem_fun)(static_cast<E*>(event));
-    }
+        uint64_t begin = current >> 32, end = current & 0xFFFFFFFF;
+        if (begin >= end) return false;
 
-    void* get_handler_ptr() override
-    {
-        return (void*) instance;
+        if (range.compare_exchange_weak(current, ((begin + 1) << 32) | end, 
+            std::memory_order_acq_rel, std::memory_order_relaxed))
+        {
+            index = begin;
+            return true;
+        }
     }
-};
+}
 
-class EventProcessor 
+bool ThreadPool::steal(size_t self)
 {
-private:
-    moodycamel::ProducerToken token; 
-    std::queue<std::shared_ptr<DeletePointerView<Event>[]>> events_queue;
-    std::queue<size_t> events_size_queue;
-    std::vector<std::vector<IEventHandler*>> handlers;  
-public:
-    EventProcessor(moodycamel::ProducerToken&& token)
-        : token(std::move(token)), handlers(max_event_types) {}
-
-    EventProcessor(const EventProcessor& other) = delete;
-    EventProcessor& operator=(const EventProcessor& other) = delete;
+    size_t threads = size();
 
-    EventProcessor(EventProcessor&& other)
-        : token(std::move(other.token)), 
-        events_queue(std::move(other.events_queue)), 
-        events_size_queue(std::move(other.events_size_queue)),
-        handlers(std::move(other.handlers)) {}
-
-    EventProcessor& operator=(EventProcessor&& other)
+    for (size_t i = 1; i < threads; i++)
     {
-        token = std::move(other.token);
-        events_queue = std::move(other.events_queue);
-        events_size_queue = std::move(other.events_size_queue);
-        handlers = std::move(other.handlers);
-        return *this;
-    }
+        auto& victim = ranges[(self + i) % threads].range;
+        uint64_t current = victim.load(std::memory_order_relaxed);
 
-    ~EventProcessor()
-    {
-        for (auto& handler : handlers)
+        for (;;)
         {
-            for (auto& x : handler)
+            uint64_t begin = current >> 32, end = current & 0xFFFFFFFF;
+            if (begin >= end) break;
+
+            // Takes the back half, rounding up so a single remaining index can be stolen too 
+            uint64_t split = begin + (end - begin) / 2;
+            if (victim.compare_exchange_weak(current, (begin << 32) | split, 
+                std::memory_order_acq_rel, std::memory_order_relaxed))
             {
-                delete x;
+                // Only this thread writes its own range once it is empty 
+                ranges[self].range.store((split << 32) | end, std::memory_order_release);
+                return true;
             }
         }
     }
-     
-    // Has a producer token for adding events
-    inline moodycamel::ProducerToken& get_producer() { return token; }
- 
-    // Managing event handlers
-    template <typename T, ValidEvent E> 
-    inline void subscribe(T* handler, handler_fun_t<T, E> handler_fun)
-    {
-        size_t e = E::id;
-        handlers[E::id].emplace_back(
-            (IEventHandler*) new EventHandler<T, E>(handler, handler_fun));
-    }
 
-    template <typename T> 
-    inline void unsubscribe(T* handler)
+    return false;
+}
+
+void ThreadPool::work(size_t self, const std::function<void(size_t)>& fun)
+{
+    do 
     {
-        for (auto grouped_handlers : handlers)
+        for (size_t index; pop_front(self, index); )
         {
-            std::erase_if(grouped_handlers, 
-                [handler](IEventHandler* x){
-                    if (handler == x->get_handler_ptr()) delete x;
-                    return handler == x->get_handler_ptr();
-            });
+            fun(index);
         }
-    }
+    } 
+    while (steal(self));
+}
 
-    // Processing events
-    void process_events();
-    void add_events(const std::shared_ptr<DeletePointerView<Event>[]>& events, 
-        size_t num_events);
-};
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)>& fun)
+{
+    // Not worth waking anyone up 
+    if (workers.empty() || count <= 1)
+    {
+        for (size_t i = 0; i < count; i++) fun(i);
+        return;
+    }
 
-#ifdef EVENT_IMPLEMENTATION
+    assert(count <= 0xFFFFFFFF);
 
-void EventProcessor::process_events()
-{
-    for (; !events_queue.empty(); )
     {
-        auto& events = events_queue.back();
-        size_t events_size = events_size_queue.back();
-        
-        for (size_t i = 0; i < events_size; i++)
+        std::unique_lock lock(job_mutex);
+
+        size_t threads = size();
+        for (size_t i = 0; i < threads; i++)
         {
-            Event* event = events[i].data(); 
-            for (auto& handler : handlers[event->get_id()])
-            {
-                handler->exec(event);
-            }
+            uint64_t begin = count * i / threads, end = count * (i + 1) / threads;
+            ranges[i].range.store((begin << 32) | end, std::memory_order_relaxed);
         }
 
-        events_queue.pop();
-        events_size_queue.pop();
+        job = &fun;
+        busy_workers = workers.size();
+        generation++;
     }
-}
+    job_start.notify_all();
 
-void EventProcessor::add_events(
-    const std::shared_ptr<DeletePointerView<Event>[]>& events, size_t num_events)
-{
-    events_queue.push(events); 
-    events_size_queue.push(num_events);
+    work(0, fun);
+
+    // Every worker has to check in, otherwise a late one could pick up the next job's indices with this job's function
+    std::unique_lock lock(job_mutex);
+    job_done.wait(lock, [&]{ return busy_workers == 0; });
+    job = nullptr;
 }
 
 #endif
 
-// Nocall are methods that cannot be called at the same time as the method being called
-class MultiEventManager
+struct EventArenaBlock;
+
+class Event
 {
 private:
-    // The number of created processor 
-    // Recyclable processors? using queue 
-    size_t subtracted = 0;
-    std::atomic<size_t> event_count = 0;
-    std::vector<EventProcessor> processors;
+    friend class EventArena;
+    friend void release_events(Event** events, size_t num_events);
 
-    // Event queue
-    moodycamel::ConcurrentQueue<std::pair<Event*, size_t>> event_queue;
+    // Set when the event lives in an arena block (created with MultiEventManager::emplace) instead of on the heap
+    EventArenaBlock* arena_block = nullptr;
 
-    // Processor and subscribe mutex
-    std::shared_mutex processor_and_sub;
+    // Id of the most derived type, read by processors instead of calling get_id
+    size_t type_id = unresolved_id;
+
+#ifdef EVENT_STATS
+    friend class EventProcessor;
+    friend class MultiEventManager;
+
+    // stats_now_ns when the event was submitted
+    uint64_t submit_ns = 0;
+#endif
 public:
-    // Creates a new processor which can be used to run processes on different threads (ie processes that use processors are thread safe)
-    size_t get_processor(); 
-    
-    // Adds a handler to a processor 
-    template <typename T, EventDerived E>
-    inline void subscribe(size_t processor_id, T* handler, 
-        handler_fun_t<T, E> handler_fun)
+    // Events that do not pass their id on construction get it from get_id when they are submitted
+    static constexpr size_t unresolved_id = SIZE_MAX;
+
+    Event() = default;
+    explicit Event(size_t type_id) : type_id(type_id) {}
+
+    virtual ~Event() {}
+    virtual constexpr size_t get_id() = 0;
+
+    inline size_t get_type_id() const { return type_id; }
+
+    // get_type_id for events that may not have been submitted, ie given straight to EventProcessor::add_events
+    // Does not store the id, the event can be in batches other threads are dispatching
+    inline size_t find_type_id()
     {
-        std::shared_lock lock(processor_and_sub);
-        processors[processor_id].subscribe(handler, handler_fun);
+        if (type_id == unresolved_id) [[unlikely]] return get_id();
+        return type_id;
     }
 
-    // Removes a handler from a processor
-    template <typename T>
-    inline void unsubscribe(size_t processor_id, T* handler)
-    {   
-        std::shared_lock lock(processor_and_sub);
-        processors[processor_id].unsubscribe(handler);
+    // Fills in the id with a virtual call if the event did not set it 
+    inline void resolve_type_id() 
+    { 
+        if (type_id == unresolved_id) type_id = get_id(); 
     }
+};
 
-    // Add an event that will be processed by every processor
-    // Should be destroyed after it is processed by every processor 
-    // This is the processor it is being submitted by, not the processor it will appear on (it will appear on all processors)
-    // Very thread safe (can be used with any method besides get_processor)
-    void submit(size_t processor_id, Event* event);
+// Base for events that store their id on construction, ie struct Tick : EventOf<Tick> 
+template <typename E>
+class EventOf : public Event
+{
+protected:
+    EventOf() : Event(E::id) {}
+};
 
-    // Process every event using a certain processor
-    // Thread safe only with submit
-    void process_events(size_t processor_id);
+template <typename T> 
+concept EventDerived = std::is_base_of_v<Event, T>;
 
-    // Takes events and moves them onto the processors so they can efficiently process events and properly delete them 
-    // Thread safe only with submit 
-    void move_to_processors();
+template <typename T>
+concept HasId = requires(T) 
+{
+    { T::id };
 };
 
-// Count sort in base N
-template <typename T, size_t N> 
-void count_sort(std::vector<std::pair<T, size_t>>& input, 
-    std::vector<std::pair<T, size_t>>& output, size_t iterations)
-{
-    size_t count[N] = {0};
-    size_t exp = std::pow(N, iterations); 
-    
-    for (size_t i = 0; i < input.size(); i++) 
-    {
-        count[(input[i].second / exp) % N]++;
-    }
+template <typename T>
+concept ValidEvent = EventDerived<T> && HasId<T>;
 
-    for (size_t i = 1; i < N; i++) 
-        count[i] += count[i - 1];
+// Largest event submit_value copies into a batch
+inline constexpr size_t max_value_event_size = 64;
 
-    for (size_t i = input.size(); i > 0; i--)
-    {
-        output[count[(input[i - 1].second / exp) % N] - 1] = input[i - 1];
-        count[(input[i - 1].second / exp) % N]--;
-    }
-}
+// Events copied by value into the batch instead of passed as Event*, handlers get a pointer into the batch
+// ie struct Tick { static const size_t id; constexpr size_t get_id(); double price; }; with EVENT_GEN(Tick)
+template <typename T>
+concept ValueEvent = !EventDerived<T> && HasId<T> && std::is_trivially_copyable_v<T> && 
+    sizeof(T) <= max_value_event_size && alignof(T) <= 8;
 
-// Radix with base N
-template <typename T, size_t N> 
-void radix(std::vector<std::pair<T, size_t>>& input)
-{
-    std::vector<std::pair<T, size_t>> s_input(input.size());
-    size_t iterations = 0;
-    size_t max_num = max_val(input);
+template <typename T>
+concept HandledEvent = ValidEvent<T> || ValueEvent<T>;
+
+template <typename T, HandledEvent E>
+using handler_fun_t = void (T::*)(E*);
 
-    while (max_num / (size_t) std::pow(N, iterations))
+// Return type of coroutine handlers and workflows, the coroutine starts right away and frees itself once it finishes 
+// Nothing waits for it, it is resumed by whatever it awaits (see MultiEventManager::next)
+struct EventTask
+{
+    struct promise_type
     {
-        count_sort<T, N>(iterations % 2 == 0 ? input : s_input, 
-            iterations % 2 == 0 ? s_input : input, iterations);   
-        iterations++;
-    }
+        EventTask get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
 
-    if (iterations % 2) input = s_input;
-}
+// Coroutine handler, ie EventTask on_order(Order* order) that co_awaits the fill
+template <typename T, HandledEvent E>
+using task_handler_fun_t = EventTask (T::*)(E*);
 
-template <typename T> 
-size_t max_val(const std::vector<std::pair<T, size_t>>& input)
+// Handlers get events as void* so value events, which are not Events, share the dispatch path
+template <HandledEvent E>
+inline E* event_cast(void* event)
 {
-    size_t max_val = 0;
-    for (auto& v : input)
-    {
-        max_val = max_val < v.second ? v.second : max_val;
-    }
-    return max_val;
+    if constexpr (ValueEvent<E>) return static_cast<E*>(event);
+    else return static_cast<E*>(static_cast<Event*>(event));
 }
 
-consteval size_t compile_pow(size_t base, size_t exp) 
-{ 
-    size_t rval = base;
-    for (size_t i = 0; i < exp; i++) rval *= base; 
-    return rval; 
-}
+// NUMA placement, without NUMA information (or off Linux) every thread is on node -1 and memory comes from the heap
 
-// Multithreaded radix, splits the numbers into buckets and then calls radix on each bucket with base N
-template <typename T, size_t N, size_t base = 4>
-std::vector<T> multithreaded_radix(
-    std::vector<std::pair<T, size_t>>& input)
-{
-    size_t max_num = max_val(input);
+// Number of NUMA nodes, 1 when there is no NUMA information
+int numa_node_count();
 
-    if (max_num == 0)
-    {
-        std::vector<T> output;
-        for (auto& val : input)
-        {
-            output.push_back(val.first); 
-        }
-        
-        return output;
-    }
-    
-    // Each bucket for each thread
-    std::array<
-        std::vector<std::pair<Event*, size_t>>, compile_pow(2, base)> buckets;
+// Node of the cpu the calling thread is running on, -1 when unknown
+int current_numa_node();
 
-    for (size_t i = 0; i < input.size(); i++)
-    {
-        buckets[input[i].second >> 
-            (bit_scan_rv(max_num) + 1 - base)].push_back(input[i]);
-    }
+// Restricts the calling thread to the cpus of a node, returns false if it could not
+bool pin_thread_to_numa_node(int node);
 
-    Timer timer;
+// Page aligned memory, preferably on node. A node of -1 leaves placement to the first touch
+// Throws std::bad_alloc like operator new
+void* numa_allocate(size_t bytes, int node);
+void numa_free(void* memory, size_t bytes);
 
-    std::array<std::thread, compile_pow(2, base)> threads;
-    for (size_t i = 0; i < threads.size(); i++)
-    {
-        threads[i] = std::thread(radix<T, N>, std::ref(buckets[i]));
-    }
+#ifdef EVENT_IMPLEMENTATION
 
-    for (auto& thread : threads)
-    {
-        thread.join();
-    }
+#ifdef __linux__
 
-    std::vector<T> output;
+// Calls fun with every cpu or node of a sysfs list like 0-3,8-11, returns false if the file could not be read
+template <typename F>
+bool read_sysfs_list(const char* path, F fun)
+{
+    std::FILE* file = std::fopen(path, "r");
+    if (!file) return false;
 
-    for (auto& bucket : buckets)
+    int first;
+    bool read = false;
+    while (std::fscanf(file, "%d", &first) == 1)
     {
-        for (auto& val : bucket)
+        int last = first;
+        int next = std::fgetc(file);
+        if (next == '-')
         {
-            output.push_back(val.first);
+            if (std::fscanf(file, "%d", &last) != 1) break;
+            next = std::fgetc(file);
         }
-    }
 
-    return output;
+        for (int i = first; i <= last; i++) fun(i);
+        read = true;
+        if (next != ',') break;
+    }
+    std::fclose(file);
+    return read;
 }
 
-std::shared_ptr<DeletePointerView<Event>[]> create_delete_shared(
-    const std::vector<Event*>& input)
+inline size_t numa_round_to_pages(size_t bytes)
 {
-    auto shared_ptr = new DeletePointerView<Event>[input.size()];
-    auto output = std::shared_ptr<DeletePointerView<Event>[]>(shared_ptr);
-    memcpy((void*) shared_ptr, (void*) input.data(), 
-        input.size() * sizeof(DeletePointerView<Event>)); 
-
-    return output;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) & ~(page - 1);
 }
 
-#ifdef EVENT_IMPLEMENTATION
-
-size_t MultiEventManager::get_processor()
+int numa_node_count()
 {
-    std::unique_lock lock(processor_and_sub);
-    processors.push_back(
-        std::move(EventProcessor(moodycamel::ProducerToken(event_queue))));
-    return processors.size() - 1;
+    int count = 0;
+    read_sysfs_list("/sys/devices/system/node/online", [&](int node) { count = std::max(count, node + 1); });
+    return std::max(count, 1);
 }
 
-void MultiEventManager::submit(size_t processor_id, Event* event)
+int current_numa_node()
 {
-    event_queue.enqueue(processors[processor_id].get_producer(), 
-        std::make_pair(event, event_count.fetch_add(1)));
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) return -1;
+    return (int) node;
 }
 
-void MultiEventManager::process_events(size_t processor_id)
+bool pin_thread_to_numa_node(int node)
 {
-    processors[processor_id].process_events();
+    if (node < 0) return false;
+
+    char path[64];
+    std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (!read_sysfs_list(path, [&](int cpu) { if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpus); })) return false;
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
 }
 
-void MultiEventManager::move_to_processors()
+void* numa_allocate(size_t bytes, int node)
 {
-    size_t event_count = this->event_count;
+    bytes = numa_round_to_pages(bytes);
+    void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) throw std::bad_alloc();
 
-    std::vector<std::pair<Event*, size_t>> stored;
-    stored.resize(event_count - subtracted);
-    size_t event_got = event_queue.try_dequeue_bulk(stored.data(), 
-        event_count - subtracted); 
+    // Before the first touch so the pages are allocated there, preferred so a full node falls back to another
+    // mbind through syscall to not depend on libnuma, a failure only costs locality
+    if (node >= 0 && node < 64)
+    {
+        constexpr int mpol_preferred = 1;
+        unsigned long mask = 1ul << node;
+        syscall(SYS_mbind, memory, bytes, mpol_preferred, &mask, sizeof(mask) * 8 + 1, 0);
+    }
+    return memory;
+}
+
+void numa_free(void* memory, size_t bytes)
+{
+    munmap(memory, numa_round_to_pages(bytes));
+}
+
+#else
+
+int numa_node_count() { return 1; }
+int current_numa_node() { return -1; }
+bool pin_thread_to_numa_node(int) { return false; }
+
+void* numa_allocate(size_t bytes, int) 
+{ 
+    return ::operator new(bytes, std::align_val_t(4096)); 
+}
+
+void numa_free(void* memory, size_t) 
+{ 
+    ::operator delete(memory, std::align_val_t(4096)); 
+}
+
+#endif
+
+#endif
+
+class EventArenaPool;
+class EventProcessor;
+
+// Chunk of memory events are bump allocated from, goes back to its pool once every event in it has been released
+struct EventArenaBlock
+{
+    static constexpr size_t size = 1 << 16;
+    static constexpr size_t header_size = 64;
+    static constexpr size_t capacity = size - header_size;
+
+    // Held by the arena allocating from the block, so consumers releasing events can never reach zero before 
+    // the arena knows how many events it handed out
+    static constexpr size_t owner_bias = size_t(1) << 62;
+
+    std::atomic<size_t> refs;
+    EventArenaPool* pool;
+
+    inline std::byte* data() { return reinterpret_cast<std::byte*>(this) + header_size; }
+
+    // Called with the number of events released from this block
+    void release(size_t count);
+};
+
+// Blocks shared by every arena of a manager (or of a NUMA node), blocks are recycled rather than freed
+class EventArenaPool
+{
+private:
+    moodycamel::ConcurrentQueue<EventArenaBlock*> free_blocks;
+    // Blocks are allocated on this node, -1 for the heap
+    int numa_node;
+public:
+    explicit EventArenaPool(int numa_node = -1) : numa_node(numa_node) {}
+    ~EventArenaPool();
+
+    EventArenaPool(const EventArenaPool& other) = delete;
+    EventArenaPool& operator=(const EventArenaPool& other) = delete;
+
+    EventArenaBlock* acquire();
+    void recycle(EventArenaBlock* block);
+};
+
+// Single threaded bump allocator for events, one per producer 
+class EventArena
+{
+private:
+    EventArenaPool* pool;
+    EventArenaBlock* block = nullptr;
+    size_t used = 0;
+    size_t allocated = 0;
+
+    // Gives up the owner hold on the current block
+    void retire();
+public:
+    EventArena(EventArenaPool* pool) : pool(pool) {}
+    ~EventArena() { retire(); }
+
+    EventArena(const EventArena& other) = delete;
+    EventArena& operator=(const EventArena& other) = delete;
+
+    EventArena(EventArena&& other)
+        : pool(other.pool), block(other.block), used(other.used), allocated(other.allocated)
+    {
+        other.block = nullptr;
+    }
+
+    EventArena& operator=(EventArena&& other)
+    {
+        retire();
+        pool = other.pool;
+        block = other.block;
+        used = other.used;
+        allocated = other.allocated;
+        other.block = nullptr;
+        return *this;
+    }
+
+    template <ValidEvent E, typename... Args>
+    E* emplace(Args&&... args)
+    {
+        // Does not fit in a block, not worth a special case
+        if constexpr (sizeof(E) > EventArenaBlock::capacity || 
+            alignof(E) > EventArenaBlock::header_size)
+        {
+            return new E(std::forward<Args>(args)...);
+        }
+        else 
+        {
+            size_t offset = (used + alignof(E) - 1) & ~(alignof(E) - 1);
+            if (!block || offset + sizeof(E) > EventArenaBlock::capacity)
+            {
+                retire();
+                block = pool->acquire();
+                offset = 0;
+            }
+
+            E* event = new (block->data() + offset) E(std::forward<Args>(args)...);
+            static_cast<Event*>(event)->arena_block = block;
+            static_cast<Event*>(event)->type_id = E::id;
+            used = offset + sizeof(E);
+            allocated++;
+            return event;
+        }
+    }
+};
+
+// Destroys events, arena events are batched so a block is only touched once per run of events from it
+void release_events(Event** events, size_t num_events);
+
+#ifdef EVENT_IMPLEMENTATION
+
+void EventArenaBlock::release(size_t count)
+{
+    if (refs.fetch_sub(count, std::memory_order_acq_rel) == count)
+    {
+        pool->recycle(this);
+    }
+}
+
+EventArenaPool::~EventArenaPool()
+{
+    EventArenaBlock* block;
+    while (free_blocks.try_dequeue(block)) 
+    {
+        if (numa_node >= 0) numa_free(block, EventArenaBlock::size);
+        else ::operator delete(block, std::align_val_t(EventArenaBlock::header_size));
+    }
+}
+
+EventArenaBlock* EventArenaPool::acquire()
+{
+    EventArenaBlock* block;
+    if (!free_blocks.try_dequeue(block))
+    {
+        block = static_cast<EventArenaBlock*>(numa_node >= 0 
+            ? numa_allocate(EventArenaBlock::size, numa_node)
+            : ::operator new(EventArenaBlock::size, std::align_val_t(EventArenaBlock::header_size)));
+        new (block) EventArenaBlock;
+        block->pool = this;
+    }
+
+    block->refs.store(EventArenaBlock::owner_bias, std::memory_order_relaxed);
+    return block;
+}
+
+void EventArenaPool::recycle(EventArenaBlock* block)
+{
+    free_blocks.enqueue(block);
+}
+
+void EventArena::retire()
+{
+    if (!block) return;
+
+    block->release(EventArenaBlock::owner_bias - allocated);
+    block = nullptr;
+    used = 0;
+    allocated = 0;
+}
+
+void release_events(Event** events, size_t num_events)
+{
+    EventArenaBlock* run_block = nullptr;
+    size_t run = 0;
+
+    for (size_t i = 0; i < num_events; i++)
+    {
+        Event* event = events[i];
+        if (!event) continue;
+
+        EventArenaBlock* block = event->arena_block;
+        if (!block)
+        {
+            delete event;
+            continue;
+        }
+
+        event->~Event();
+        if (block != run_block)
+        {
+            if (run_block) run_block->release(run);
+            run_block = block;
+            run = 0;
+        }
+        run++;
+    }
+
+    if (run_block) run_block->release(run);
+}
+
+#endif
+
+// Header of one event in the record part of a batch, followed by size bytes holding the event
+struct ValueRecord
+{
+    // id of a record holding an Event* instead of a value event
+    static constexpr uint32_t pointer_record = UINT32_MAX;
+
+    uint32_t id;
+    // Multiple of 8 so the next record stays aligned
+    uint32_t size;
+
+    inline void* data() { return this + 1; }
+    inline ValueRecord* next() { return reinterpret_cast<ValueRecord*>(reinterpret_cast<unsigned char*>(this + 1) + size); }
+};
+
+// Events handed to the processors by one move_to_processors call
+// The reference count, the size and the events share one allocation, and the events are released together
+// once the last processor is done with the batch
+// Batches with value events also carry every event as a record in order after the Event* array, which then only
+// exists to release the events
+class EventBatch
+{
+private:
+    std::atomic<size_t> refs;
+    size_t num_events;
+    size_t num_values;
+    size_t record_bytes;
+
+    // Filtered views of the events handed to processors that only handle some of them
+    std::unique_ptr<Event*[]> subsets;
+
+    // Processor each record is partitioned to, nullptr for records every processor gets
+    std::unique_ptr<const EventProcessor*[]> owners;
+
+    // Set on a replica, which holds a reference to the batch it copied and is freed with numa_free
+    EventBatch* origin = nullptr;
+    size_t replica_bytes = 0;
+
+    // Records that live outside the batch, ie in a mapped journal segment kept alive by records_owner
+    ValueRecord* external_records = nullptr;
+    std::shared_ptr<const void> records_owner;
+
+    EventBatch(size_t num_events, size_t refs, size_t num_values, size_t record_bytes) 
+        : refs(refs), num_events(num_events), num_values(num_values), record_bytes(record_bytes) {}
+public:
+    EventBatch(const EventBatch& other) = delete;
+    EventBatch& operator=(const EventBatch& other) = delete;
+
+    // Room for num_events events and record_bytes of records, holding refs references
+    // Records get max_value_event_size bytes of slack so the last one can be written with a full size copy
+    static EventBatch* create(size_t num_events, size_t refs = 1, size_t num_values = 0, size_t record_bytes = 0);
+
+    // Batch of num_values value events whose records are read in place, owner is kept until the batch is freed
+    static EventBatch* create_external(ValueRecord* records, size_t num_values, size_t record_bytes, 
+        std::shared_ptr<const void> owner, size_t refs = 1);
+
+    // Copy of a batch on a NUMA node holding one reference, the events are still released by the origin
+    // Made after the origin is complete, owners are read from the origin
+    static EventBatch* create_replica(EventBatch* origin, int node);
+
+    inline Event** data() { return reinterpret_cast<Event**>(this + 1); }
+    inline Event* const* data() const { return reinterpret_cast<Event* const*>(this + 1); }
+    inline size_t size() const { return num_events; }
+
+    inline ValueRecord* records() 
+    { 
+        return external_records ? external_records : reinterpret_cast<ValueRecord*>(data() + num_events); 
+    }
+    inline ValueRecord* records_end() 
+    { 
+        return reinterpret_cast<ValueRecord*>(reinterpret_cast<unsigned char*>(records()) + record_bytes); 
+    }
+    inline bool has_values() const { return num_values != 0; }
+    inline size_t value_count() const { return num_values; }
+    inline size_t bytes() const { return sizeof(EventBatch) + num_events * sizeof(Event*) + record_bytes; }
+
+    // Room for count event pointers that live as long as the batch, before the batch is shared
+    inline Event** allocate_subsets(size_t count) 
+    { 
+        subsets.reset(new Event*[count]); 
+        return subsets.get(); 
+    }
+
+    // One owner per record, before the batch is shared
+    inline const EventProcessor** allocate_owners() 
+    { 
+        owners.reset(new const EventProcessor*[num_events + num_values]); 
+        return owners.get(); 
+    }
+    inline const EventProcessor* const* record_owners() const 
+    { 
+        return origin ? origin->owners.get() : owners.get(); 
+    }
+
+    // Drops events from the end after they were moved around, before the batch is shared
+    // Batches with values keep their Event* count and null the dropped entries instead, since the records follow them
+    inline void shrink_events(size_t count) { num_events = count; }
+    inline void shrink_records(size_t values, size_t bytes) 
+    { 
+        num_values = values; 
+        record_bytes = bytes; 
+    }
+
+    inline void acquire(size_t count = 1) { refs.fetch_add(count, std::memory_order_relaxed); }
+
+    // Releases the events and frees the batch when this was the last reference
+    void release();
+};
+
+static_assert(sizeof(EventBatch) % alignof(Event*) == 0);
+
+#ifdef EVENT_IMPLEMENTATION
+
+EventBatch* EventBatch::create(size_t num_events, size_t refs, size_t num_values, size_t record_bytes)
+{
+    size_t slack = record_bytes ? max_value_event_size : 0;
+    void* memory = ::operator new(sizeof(EventBatch) + num_events * sizeof(Event*) + record_bytes + slack);
+    return new (memory) EventBatch(num_events, refs, num_values, record_bytes);
+}
+
+EventBatch* EventBatch::create_external(ValueRecord* records, size_t num_values, size_t record_bytes, 
+    std::shared_ptr<const void> owner, size_t refs)
+{
+    EventBatch* batch = create(0, refs);
+    batch->num_values = num_values;
+    batch->record_bytes = record_bytes;
+    batch->external_records = records;
+    batch->records_owner = std::move(owner);
+    return batch;
+}
+
+EventBatch* EventBatch::create_replica(EventBatch* origin, int node)
+{
+    size_t bytes = origin->bytes() + max_value_event_size;
+    void* memory = numa_allocate(bytes, node);
+    auto* replica = new (memory) EventBatch(origin->num_events, 1, origin->num_values, origin->record_bytes);
+    memcpy(replica->data(), origin->data(), origin->num_events * sizeof(Event*));
+    memcpy(replica->records(), origin->records(), origin->record_bytes);
+    replica->origin = origin;
+    replica->replica_bytes = bytes;
+    origin->acquire();
+    return replica;
+}
+
+void EventBatch::release()
+{
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+    if (origin)
+    {
+        EventBatch* copied = origin;
+        size_t bytes = replica_bytes;
+        this->~EventBatch();
+        numa_free(this, bytes);
+        copied->release();
+        return;
+    }
+
+    release_events(data(), num_events);
+    this->~EventBatch();
+    ::operator delete((void*) this);
+}
+
+#endif
+
+// What a full BatchQueue does with a new batch
+enum class Backpressure
+{
+    // Waits for the processor to make room
+    block,
+    // Releases the oldest batch that has not been processed yet
+    drop_oldest,
+    // Links a ring twice the size, memory only grows with the longest backlog
+    grow
+};
+
+struct BatchEntry
+{
+    EventBatch* batch;
+    // batch->data() or a subset of it that lives in the batch
+    Event* const* events;
+    size_t size;
+};
+
+// Single producer single consumer queue of batches waiting for a processor, a fixed ring of entries so 
+// add_events and process_events can run on different threads without locks or allocations
+class BatchQueue
+{
+private:
+    struct Slot
+    {
+        std::atomic<EventBatch*> batch = nullptr;
+        std::atomic<Event* const*> events = nullptr;
+        std::atomic<size_t> size = 0;
+    };
+
+    struct Ring
+    {
+        size_t mask;
+        std::unique_ptr<Slot[]> slots;
+
+        // The producer moves head as well when it drops the oldest entry, so the consumer claims entries with a CAS
+        alignas(64) std::atomic<size_t> head = 0;
+        alignas(64) std::atomic<size_t> tail = 0;
+
+        // Set by the producer when it grew, the consumer moves on once this ring is empty
+        std::atomic<Ring*> next = nullptr;
+
+        explicit Ring(size_t capacity) : mask(capacity - 1), slots(new Slot[capacity]) {}
+        inline size_t capacity() const { return mask + 1; }
+    };
+
+    Backpressure policy;
+
+    // Producer only
+    Ring* write_ring;
+    // Consumer only
+    Ring* read_ring;
+
+    // Mirrors of the rings for size_approx, which can not walk rings the consumer frees
+    // Written by the producer, dropped counts the entries drop_oldest released
+    alignas(64) std::atomic<size_t> pushed = 0;
+    std::atomic<size_t> dropped = 0;
+    // Written by the consumer
+    alignas(64) std::atomic<size_t> popped = 0;
+public:
+    // capacity is rounded up to a power of two
+    BatchQueue(size_t capacity, Backpressure policy);
+    ~BatchQueue();
+
+    BatchQueue(const BatchQueue& other) = delete;
+    BatchQueue& operator=(const BatchQueue& other) = delete;
+
+    // Producer, takes over the reference to entry.batch
+    void push(const BatchEntry& entry);
+
+    // Consumer, hands the reference to entry.batch to the caller
+    bool pop(BatchEntry& entry);
+
+    // Number of entries waiting, only exact when neither side is running. Safe to call from any thread
+    size_t size_approx() const;
+};
+
+#ifdef EVENT_IMPLEMENTATION
+
+BatchQueue::BatchQueue(size_t capacity, Backpressure policy)
+    : policy(policy)
+{
+    size_t rounded = 1;
+    while (rounded < capacity) rounded <<= 1;
+    write_ring = read_ring = new Ring(rounded);
+}
+
+BatchQueue::~BatchQueue()
+{
+    BatchEntry entry;
+    while (pop(entry))
+    {
+        entry.batch->release();
+    }
+    delete read_ring;
+}
+
+void BatchQueue::push(const BatchEntry& entry)
+{
+    Ring* ring = write_ring;
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        size_t head = ring->head.load(std::memory_order_acquire);
+        if (tail - head < ring->capacity()) break;
+
+        if (policy == Backpressure::block)
+        {
+            std::this_thread::yield();
+        }
+        else if (policy == Backpressure::drop_oldest)
+        {
+            // The consumer read of this slot fails its CAS, so the batch is ours to release 
+            if (ring->head.compare_exchange_strong(head, head + 1, std::memory_order_acq_rel))
+            {
+                ring->slots[head & ring->mask].batch.load(std::memory_order_relaxed)->release();
+                dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            }
+        }
+        else 
+        {
+            Ring* bigger = new Ring(ring->capacity() * 2);
+            ring->next.store(bigger, std::memory_order_release);
+            write_ring = ring = bigger;
+            tail = 0;
+            break;
+        }
+    }
+
+    auto& slot = ring->slots[tail & ring->mask];
+    slot.batch.store(entry.batch, std::memory_order_relaxed);
+    slot.events.store(entry.events, std::memory_order_relaxed);
+    slot.size.store(entry.size, std::memory_order_relaxed);
+    ring->tail.store(tail + 1, std::memory_order_release);
+    pushed.store(pushed.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+bool BatchQueue::pop(BatchEntry& entry)
+{
+    for (;;)
+    {
+        Ring* ring = read_ring;
+        size_t head = ring->head.load(std::memory_order_acquire);
+        size_t tail;
+
+        while (head != (tail = ring->tail.load(std::memory_order_acquire)))
+        {
+            auto& slot = ring->slots[head & ring->mask];
+            entry.batch = slot.batch.load(std::memory_order_relaxed);
+            entry.events = slot.events.load(std::memory_order_relaxed);
+            entry.size = slot.size.load(std::memory_order_relaxed);
+
+            // Fails when the producer dropped this entry, the slot may already hold something else then
+            if (ring->head.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel, 
+                std::memory_order_acquire))
+            {
+                popped.store(popped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+
+        Ring* next = ring->next.load(std::memory_order_acquire);
+        if (!next) return false;
+
+        // Entries pushed before the producer moved on are visible now, take them first
+        if (ring->tail.load(std::memory_order_acquire) != head) continue;
+
+        read_ring = next;
+        delete ring;
+    }
+}
+
+size_t BatchQueue::size_approx() const
+{
+    // Retried a few times while pushes land in between, so the count of taken entries is read against a pushed 
+    // that held at the time and the result is a size the queue really had
+    size_t added = pushed.load(std::memory_order_acquire), taken;
+    for (int tries = 0; tries < 8; tries++)
+    {
+        taken = popped.load(std::memory_order_acquire) + dropped.load(std::memory_order_acquire);
+        size_t again = pushed.load(std::memory_order_acquire);
+        if (again == added) break;
+        added = again;
+    }
+    return added > taken ? added - taken : 0;
+}
+
+#endif
+
+#define EVENT_GEN(x)
+
+#ifdef EVENT_IMPLEMENTATION
+
+template <unsigned int N>
+struct reader 
+{
+    friend auto counted_flag(reader);
+};
+
+template <unsigned int N>
+struct setter 
+{
+    friend auto counted_flag(reader<N>) {}
+    static constexpr unsigned n = N;
+};
+
+template <
+    auto Tag,
+    unsigned NextVal = 0
+>
+consteval auto counter_impl() 
+{
+    constexpr bool counted_past_value = requires(reader<NextVal> r) 
+    {
+        counted_flag(r);
+    };
+
+    if constexpr (counted_past_value) 
+    {
+        return counter_impl<Tag, NextVal + 1>();
+    }
+    else 
+    {
+        return setter<NextVal>::n;
+    }
+}
+
+template <
+    auto Tag = []{},
+    auto Val = counter_impl<Tag>()
+>
+constexpr auto counter = Val;
+
+#define EVENT_CONCAT_INNER(a, b) a##b
+#define EVENT_CONCAT(a, b) EVENT_CONCAT_INNER(a, b)
+
+#undef EVENT_GEN
+#define EVENT_GEN(x) const size_t x::id = counter<>;\
+constexpr size_t x::get_id() { return x::id; }\
+static const bool EVENT_CONCAT(event_gen_registered_, __COUNTER__) = register_event_size<x>();
+
+#endif
+
+extern const size_t max_event_types;
+
+// sizeof of the value event with an id, 0 for Event types and unknown ids. Filled by EVENT_GEN before main, 
+// so records that come from outside the process (journals, shm rings) can be checked before a handler reads them
+inline std::vector<uint32_t>& value_event_sizes()
+{
+    static std::vector<uint32_t> sizes;
+    return sizes;
+}
+
+template <typename T>
+inline bool register_event_size()
+{
+    auto& sizes = value_event_sizes();
+    if (sizes.size() <= T::id) sizes.resize(T::id + 1, 0);
+    if constexpr (ValueEvent<T>) sizes[T::id] = (uint32_t) sizeof(T);
+    return true;
+}
+
+inline size_t value_event_size(size_t id)
+{
+    auto& sizes = value_event_sizes();
+    return id < sizes.size() ? sizes[id] : 0;
+}
+
+// A subscribed handler, stored by value so dispatch is one indirect call through trampoline 
+// over data that sits next to the other handlers of the same event
+struct HandlerEntry
+{
+    using trampoline_t = void (*)(const HandlerEntry&, void*);
+
+    void* instance;
+    trampoline_t trampoline;
+
+    // Member function pointer of handlers subscribed at runtime, unused by compile time handlers
+    alignas(void*) unsigned char mem_fun[2 * sizeof(void*)];
+
+    // An Event* or a pointer to a value event in a batch
+    inline void exec(void* event) const { trampoline(*this, event); }
+
+    template <typename T, HandledEvent E>
+    static HandlerEntry make(T* instance, handler_fun_t<T, E> mem_fun)
+    {
+        static_assert(sizeof(mem_fun) <= sizeof(HandlerEntry::mem_fun), 
+            "Member function pointer does not fit in a handler entry");
+
+        HandlerEntry entry { (void*) instance, 
+            [](const HandlerEntry& self, void* event) {
+                handler_fun_t<T, E> mem_fun;
+                memcpy((void*) &mem_fun, self.mem_fun, sizeof(mem_fun));
+                (static_cast<T*>(self.instance)->*mem_fun)(event_cast<E>(event));
+            }, {} };
+        memcpy(entry.mem_fun, (void*) &mem_fun, sizeof(mem_fun));
+        return entry;
+    }
+
+    // The member function is known at compile time so it gets inlined into the trampoline
+    template <auto MemFun, typename T, HandledEvent E>
+    static HandlerEntry make(T* instance)
+    {
+        return { (void*) instance, 
+            [](const HandlerEntry& self, void* event) {
+                (static_cast<T*>(self.instance)->*MemFun)(event_cast<E>(event));
+            }, {} };
+    }
+};
+
+// Splits a member function pointer used as a template argument into its class and event
+template <auto MemFun>
+struct member_handler;
+
+template <typename T, HandledEvent E, handler_fun_t<T, E> MemFun>
+struct member_handler<MemFun>
+{
+    using handler_type = T;
+    using event_type = E;
+};
+
+// The task is dropped, the coroutine runs until its first suspension inside the dispatch
+template <typename T, HandledEvent E, task_handler_fun_t<T, E> MemFun>
+struct member_handler<MemFun>
+{
+    using handler_type = T;
+    using event_type = E;
+};
+
+// Stable counting sort of size values from input to output by key(value), which has to be below buckets
+// count needs room for buckets entries
+template <typename T, typename Key>
+void count_sort_by(const T* input, T* output, size_t size, 
+    size_t* count, size_t buckets, Key&& key)
+{
+    std::fill(count, count + buckets, 0);
+
+    for (size_t i = 0; i < size; i++) 
+    {
+        count[key(input[i])]++;
+    }
+
+    for (size_t i = 1; i < buckets; i++) 
+        count[i] += count[i - 1];
+
+    for (size_t i = size; i > 0; i--)
+    {
+        output[--count[key(input[i - 1])]] = input[i - 1];
+    }
+}
+
+// How an EventProcessor walks through a batch
+enum class DispatchMode
+{
+    // Events are handled in batch order
+    sequence,
+    // Groups the batch by event id and runs each handler over the whole group, events of different types
+    // are no longer handled in batch order but it keeps one handler list hot at a time
+    // Batches holding value events are always handled in batch order
+    by_type
+};
+
+#ifdef EVENT_PROFILE_HANDLERS
+
+// Every EVENT_PROFILE_SAMPLE-th call of a handler is timed
+#ifndef EVENT_PROFILE_SAMPLE
+#define EVENT_PROFILE_SAMPLE 16
+#endif
+
+// Written by the dispatching thread
+struct HandlerProfile
+{
+    StatCounter calls;
+    StatCounter sampled_calls;
+    StatCounter sampled_ns;
+    StatCounter max_ns;
+};
+
+// One subscription of one processor, max_ns is the slowest sampled call
+struct HandlerProfileStats
+{
+    size_t processor_id = 0;
+    size_t event_id = 0;
+    void* instance = nullptr;
+
+    uint64_t calls = 0;
+    uint64_t sampled_calls = 0;
+    uint64_t sampled_ns = 0;
+    uint64_t max_ns = 0;
+
+    // Estimated time of every call from the sampled ones
+    inline uint64_t estimated_total_ns() const 
+    { 
+        return sampled_calls ? sampled_ns * calls / sampled_calls : 0; 
+    }
+};
+
+#endif
+
+struct HandlerSlot
+{
+    HandlerEntry entry;
+    std::atomic<bool> active;
+
+    // Index into the processor's subscription directory, only used by writers
+    uint32_t subscription;
+
+#ifdef EVENT_PROFILE_HANDLERS
+    mutable HandlerProfile profile;
+#endif
+
+    inline void exec(void* event) const
+    {
+#ifdef EVENT_PROFILE_HANDLERS
+        uint64_t calls = profile.calls.get();
+        profile.calls.set(calls + 1);
+        if (calls % EVENT_PROFILE_SAMPLE == 0)
+        {
+            Timer<std::chrono::steady_clock> timer;
+            entry.exec(event);
+            uint64_t ns = timer.get_time_ns().count();
+
+            profile.sampled_calls.add(1);
+            profile.sampled_ns.add(ns);
+            if (ns > profile.max_ns.get()) profile.max_ns.set(ns);
+            return;
+        }
+#endif
+        entry.exec(event);
+    }
+};
+
+// Handlers of one event id on one processor
+// Subscribing appends in place and publishes the new size, unsubscribing only clears active, so dispatch 
+// never sees a slot change under it. Lists are replaced when they are full or have more removed than live slots
+struct HandlerList
+{
+    std::unique_ptr<HandlerSlot[]> slots;
+    size_t capacity;
+    std::atomic<size_t> size = 0;
+
+    // Writers only
+    size_t removed = 0;
+
+    explicit HandlerList(size_t capacity) 
+        : slots(new HandlerSlot[capacity]), capacity(capacity) {}
+
+    inline size_t live() const { return size.load(std::memory_order_relaxed) - removed; }
+
+    template <typename F>
+    inline void for_each(F&& fun) const
+    {
+        size_t num_slots = size.load(std::memory_order_acquire);
+        for (size_t i = 0; i < num_slots; i++)
+        {
+            if (slots[i].active.load(std::memory_order_relaxed)) fun(slots[i]);
+        }
+    }
+};
+
+// Returned by subscribe, unsubscribing with it is constant time instead of a scan of every handler list
+struct SubscriptionHandle
+{
+    size_t event_id = SIZE_MAX;
+    uint32_t slot = 0;
+    uint32_t generation = 0;
+};
+
+#ifdef EVENT_STATS
+
+// Log linear histogram, each power of two is split into sub_buckets buckets so percentiles are within 25%
+struct HistogramSnapshot
+{
+    static constexpr size_t sub_bits = 2;
+    static constexpr size_t sub_buckets = size_t(1) << sub_bits;
+    static constexpr size_t num_buckets = (64 - sub_bits + 1) * sub_buckets;
+
+    std::array<uint64_t, num_buckets> counts{};
+
+    static inline size_t bucket_of(uint64_t value)
+    {
+        if (value < sub_buckets) return value;
+        size_t msb = std::bit_width(value) - 1;
+        return (msb - sub_bits + 1) * sub_buckets + ((value >> (msb - sub_bits)) & (sub_buckets - 1));
+    }
+
+    // Smallest value that lands in bucket
+    static inline uint64_t bucket_floor(size_t bucket)
+    {
+        if (bucket < sub_buckets) return bucket;
+        size_t msb = bucket / sub_buckets - 1 + sub_bits;
+        return uint64_t(sub_buckets + bucket % sub_buckets) << (msb - sub_bits);
+    }
+
+    uint64_t total() const;
+
+    // Upper bound of the bucket holding quantile p of the recorded values, p in [0, 1]
+    uint64_t percentile(double p) const;
+};
+
+// Histogram written by a single thread
+class StatHistogram
+{
+private:
+    StatCounter buckets[HistogramSnapshot::num_buckets];
+public:
+    inline void record(uint64_t value) { buckets[HistogramSnapshot::bucket_of(value)].add(1); }
+    HistogramSnapshot snapshot() const;
+};
+
+struct ProcessorStats
+{
+    uint64_t events_dispatched = 0;
+    uint64_t batches_dispatched = 0;
+    // Batches handed to the processor that it has not processed yet
+    uint64_t queue_depth = 0;
+    uint64_t dispatch_ns = 0;
+    // From submit until the batch holding the event started dispatching
+    HistogramSnapshot latency_ns;
+};
+
+struct EventStats
+{
+    uint64_t events_moved = 0;
+    uint64_t batches_moved = 0;
+    HistogramSnapshot batch_sizes;
+    // Of events_moved, dropped by conflate before reaching a processor
+    uint64_t events_conflated = 0;
+
+    // Time move_to_processors spent dequeuing and handing batches to the processors, and ordering them 
+    // (a plain copy with per_producer ordering)
+    uint64_t copy_ns = 0;
+    uint64_t sort_ns = 0;
+
+    std::vector<ProcessorStats> processors;
+};
+
+#ifdef EVENT_IMPLEMENTATION
+
+uint64_t HistogramSnapshot::total() const
+{
+    uint64_t sum = 0;
+    for (uint64_t count : counts) sum += count;
+    return sum;
+}
+
+uint64_t HistogramSnapshot::percentile(double p) const
+{
+    uint64_t sum = total();
+    if (sum == 0) return 0;
+
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t) std::ceil(p * sum));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < num_buckets; bucket++)
+    {
+        seen += counts[bucket];
+        if (seen >= rank) 
+            return bucket + 1 < num_buckets ? bucket_floor(bucket + 1) - 1 : UINT64_MAX;
+    }
+    return UINT64_MAX;
+}
+
+HistogramSnapshot StatHistogram::snapshot() const
+{
+    HistogramSnapshot rval;
+    for (size_t i = 0; i < HistogramSnapshot::num_buckets; i++)
+    {
+        rval.counts[i] = buckets[i].get();
+    }
+    return rval;
+}
+
+#endif
+
+#endif
+
+// Subscription changes never wait for or race with process_events, lists that have to be replaced are swapped 
+// in atomically, retired with the epoch they were replaced in and freed once the dispatching thread has moved 
+// past that epoch
+class EventProcessor 
+{
+private:
+    moodycamel::ProducerToken token; 
+    EventArena arena;
+    BatchQueue events_queue;
+
+    // One list per event id, nullptr when nothing handles it
+    std::unique_ptr<std::atomic<HandlerList*>[]> handlers;  
+
+    // Bit per event id with a list in handlers, move_to_processors reads it to skip what nothing here handles
+    std::unique_ptr<std::atomic<uint64_t>[]> subscribed;
+
+    // Writers only, subscribe and unsubscribe still wait for each other
+    std::mutex subscribe_mutex;
+    std::vector<std::pair<HandlerList*, uint64_t>> retired;
+
+    // Where each subscription is, handles index into this
+    struct Subscription
+    {
+        size_t event_id;
+        size_t position;
+        uint32_t generation = 0;
+        bool used = false;
+    };
+    std::vector<Subscription> subscriptions;
+    std::vector<uint32_t> free_subscriptions;
+    std::atomic<size_t> retired_count = 0;
+
+    // Bumped every time a list is replaced, starts at 1 so dispatch_epoch can use 0 for not dispatching 
+    std::atomic<uint64_t> handler_epoch = 1;
+    // The handler_epoch the dispatching thread last entered, lists retired after it may still be in use
+    std::atomic<uint64_t> dispatch_epoch = 0;
+
+    // How many events ahead of the one being dispatched get prefetched
+    static constexpr size_t prefetch_distance = 8;
+
+    DispatchMode dispatch_mode = DispatchMode::sequence;
+
+    // Node the thread processing this runs on, -1 when not given
+    int numa_node;
+
+    // Coroutines waiting for the next event of an id, dispatch only looks at them while awaiting_count is not 0
+    struct AwaitingEvent
+    {
+        size_t id;
+        std::coroutine_handle<> handle;
+        void** event;
+        // Value of await_registrations when it started waiting
+        uint64_t registration;
+    };
+    std::atomic<size_t> awaiting_count = 0;
+    // Bumped by every await_event, dispatch reads it before the handlers of an event so coroutines those 
+    // handlers start waiting wait for a later event
+    std::atomic<uint64_t> await_registrations = 0;
+    std::mutex await_mutex;
+    std::vector<AwaitingEvent> awaiting;
+    std::vector<AwaitingEvent> resuming;
+    std::unique_ptr<std::atomic<uint64_t>[]> awaited;
+
+    // Coroutines continued on this processor by post
+    moodycamel::ConcurrentQueue<std::coroutine_handle<>> posted;
+
+    // Resumes the coroutines waiting for id with event, after its handlers ran
+    // Only the ones that started waiting before registrations, which is read before the handlers
+    void resume_awaiting(size_t id, void* event, uint64_t registrations);
+    inline uint64_t awaits_registered() const { return await_registrations.load(std::memory_order_relaxed); }
+    inline void maybe_resume_awaiting(size_t id, void* event, uint64_t registrations)
+    {
+        if (awaiting_count.load(std::memory_order_relaxed) != 0) [[unlikely]] resume_awaiting(id, event, registrations);
+    }
+    void resume_posted();
+
+    // Wakes a thread parked in wait_for_events
+    void notify_waiters();
+
+    // Eventcount for wait_for_events, add_events only takes wait_mutex when a consumer is parked
+    std::atomic<uint32_t> waiters = 0;
+    std::mutex wait_mutex;
+    std::condition_variable wait_cv;
+
+#ifdef EVENT_STATS
+    // Written by the thread calling process_events
+    alignas(64) StatCounter stat_events_dispatched;
+    StatCounter stat_batches_dispatched;
+    StatCounter stat_dispatch_ns;
+    StatHistogram stat_latency_ns;
+    // When the batch being dispatched started
+    uint64_t stat_dispatch_start = 0;
+    // Events of that batch this processor dispatched
+    uint64_t stat_batch_events = 0;
+
+    // Recorded as each event is dispatched, events that did not come through submit have no stamp
+    inline void record_latency(const Event* event)
+    {
+        if (event->submit_ns != 0) stat_latency_ns.record(stat_dispatch_start - event->submit_ns);
+    }
+#endif
+
+    // Reused between batches by DispatchMode::by_type
+    std::vector<std::pair<Event*, size_t>> by_type_input;
+    std::vector<std::pair<Event*, size_t>> by_type_output;
+    std::vector<size_t> by_type_count;
+
+    void dispatch_by_type(Event* const* events, size_t num_events);
+    void dispatch_records(EventBatch* batch);
+
+    // Sequentially consistent with the epoch accesses, see enter_dispatch
+    inline HandlerList* get_handlers(size_t id) const 
+    { 
+        return handlers[id].load(std::memory_order_seq_cst); 
+    }
+
+    // Publishes the current handler epoch as the one the dispatching thread is in
+    void enter_dispatch();
+    void exit_dispatch();
+
+    // Writers, need subscribe_mutex
+    void replace_handlers(size_t id, HandlerList* list);
+    void reclaim_handlers();
+
+    // Copies the live slots of id into a new list with room for extra more, keeping their order
+    HandlerList* rebuild_handlers(size_t id, size_t extra);
+    void remove_slot(HandlerList* list, size_t position);
+public:
+    EventProcessor(moodycamel::ProducerToken&& token, EventArenaPool* arena_pool, 
+        size_t queue_capacity = 64, Backpressure backpressure = Backpressure::grow, int numa_node = -1);
+    ~EventProcessor();
+
+    EventProcessor(const EventProcessor& other) = delete;
+    EventProcessor& operator=(const EventProcessor& other) = delete;
+     
+    // Has a producer token for adding events
+    inline moodycamel::ProducerToken& get_producer() { return token; }
+
+    // Allocates events created by the thread that submits through this processor
+    inline EventArena& get_arena() { return arena; }
+ 
+    // Managing event handlers, safe to call from any thread while events are processed
+    // A handler may still be called by a process_events that was already running when unsubscribe returns
+    template <typename T, HandledEvent E> 
+    inline SubscriptionHandle subscribe(T* handler, handler_fun_t<T, E> handler_fun)
+    {
+        return add_handler(E::id, HandlerEntry::make<T, E>(handler, handler_fun));
+    }
+
+    template <auto MemFun> 
+    inline SubscriptionHandle subscribe(typename member_handler<MemFun>::handler_type* handler)
+    {
+        using E = typename member_handler<MemFun>::event_type;
+        return add_handler(E::id, HandlerEntry::make<MemFun, 
+            typename member_handler<MemFun>::handler_type, E>(handler));
+    }
+
+    // Removes every subscription of handler, scans every handler list
+    template <typename T> 
+    inline void unsubscribe(T* handler)
+    {
+        remove_handlers((void*) handler);
+    }
+
+    // Removes one subscription, returns false if it was already removed
+    bool unsubscribe(const SubscriptionHandle& handle);
+
+    SubscriptionHandle add_handler(size_t id, const HandlerEntry& entry);
+    void remove_handlers(void* instance);
+
+    // Nocall: process_events
+    inline void set_dispatch_mode(DispatchMode mode) { dispatch_mode = mode; }
+
+    inline int get_numa_node() const { return numa_node; }
+
+    // Processing events
+    void process_events();
+
+    // Parks the thread until a batch or a posted coroutine is waiting or timeout passes, returns false if it timed out
+    // Same thread as process_events
+    bool wait_for_events(std::chrono::nanoseconds timeout);
+
+    // Suspended coroutine resumed by process_events once the next event of id is dispatched, after its handlers, 
+    // with *event pointing at it. The event whose handlers start the wait is not the next one, in 
+    // DispatchMode::by_type neither are the others of its run. Very thread safe
+    void await_event(size_t id, std::coroutine_handle<> handle, void** event);
+
+    // Resumes a suspended coroutine at the start of process_events or between its batches. Very thread safe
+    void post(std::coroutine_handle<> handle);
+
+#ifdef EVENT_STATS
+    // Safe to call from any thread
+    ProcessorStats get_stats() const;
+#endif
+
+#ifdef EVENT_PROFILE_HANDLERS
+    // Appends the profile of every current subscription, safe to call from any thread 
+    // Waits for subscribe and unsubscribe
+    void get_handler_profile(std::vector<HandlerProfileStats>& output);
+#endif
+
+    // Takes over one reference to the batch, which is released once its events have been processed
+    // Can be called from a different thread than process_events, but only from one thread at a time
+    void add_events(EventBatch* events);
+
+    // Same as add_events but only processes n events of the batch, which have to live in the batch
+    void add_events(EventBatch* batch, Event* const* events, size_t n);
+
+    // Words of subscription_mask_words() bits, bit i is set while event id i has handlers here
+    // Safe to read from any thread, it changes with subscribe and unsubscribe
+    static inline size_t subscription_mask_words() { return (max_event_types + 63) / 64; }
+    // Ids awaited by coroutines count as subscribed
+    inline uint64_t subscription_mask(size_t word) const 
+    { 
+        return subscribed[word].load(std::memory_order_relaxed) | awaited[word].load(std::memory_order_relaxed); 
+    }
+};
+
+// co_await manager.next<E>(processor_id), gives the E
+template <HandledEvent E>
+class NextEvent
+{
+private:
+    EventProcessor* processor;
+    void* event = nullptr;
+public:
+    explicit NextEvent(EventProcessor* processor) : processor(processor) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { processor->await_event(E::id, handle, &event); }
+    E* await_resume() const noexcept { return event_cast<E>(event); }
+};
+
+// co_await manager.resume_on(processor_id), continues the coroutine inside process_events of the processor
+class ResumeOn
+{
+private:
+    EventProcessor* processor;
+public:
+    explicit ResumeOn(EventProcessor* processor) : processor(processor) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { processor->post(handle); }
+    void await_resume() const noexcept {}
+};
+
+#ifdef EVENT_IMPLEMENTATION
+
+EventProcessor::EventProcessor(moodycamel::ProducerToken&& token, EventArenaPool* arena_pool, 
+    size_t queue_capacity, Backpressure backpressure, int numa_node)
+    : token(std::move(token)), arena(arena_pool), 
+    events_queue(queue_capacity, backpressure),
+    handlers(new std::atomic<HandlerList*>[max_event_types]),
+    subscribed(new std::atomic<uint64_t>[subscription_mask_words()]),
+    numa_node(numa_node),
+    awaited(new std::atomic<uint64_t>[subscription_mask_words()])
+{
+    for (size_t i = 0; i < max_event_types; i++)
+    {
+        handlers[i].store(nullptr, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < subscription_mask_words(); i++)
+    {
+        subscribed[i].store(0, std::memory_order_relaxed);
+        awaited[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+EventProcessor::~EventProcessor()
+{
+    // Coroutines that never got their event
+    for (auto& waiting : awaiting)
+    {
+        waiting.handle.destroy();
+    }
+    std::coroutine_handle<> handle;
+    while (posted.try_dequeue(handle))
+    {
+        handle.destroy();
+    }
+
+    for (size_t i = 0; i < max_event_types; i++)
+    {
+        delete handlers[i].load(std::memory_order_relaxed);
+    }
+
+    for (auto& [list, epoch] : retired)
+    {
+        delete list;
+    }
+}
+
+void EventProcessor::enter_dispatch()
+{
+    // All of these are seq_cst, so either reclaim_handlers sees this epoch or the list loads after it see 
+    // the replaced lists
+    dispatch_epoch.store(handler_epoch.load(std::memory_order_seq_cst), 
+        std::memory_order_seq_cst);
+}
+
+void EventProcessor::exit_dispatch()
+{
+    dispatch_epoch.store(0, std::memory_order_release);
+
+    // Frees lists here too so they do not pile up when subscriptions stop changing
+    if (retired_count.load(std::memory_order_relaxed))
+    {
+        std::unique_lock lock(subscribe_mutex, std::try_to_lock);
+        if (lock.owns_lock()) reclaim_handlers();
+    }
+}
+
+void EventProcessor::replace_handlers(size_t id, HandlerList* list)
+{
+    HandlerList* old = handlers[id].exchange(list, std::memory_order_seq_cst);
+
+    uint64_t bit = uint64_t(1) << (id % 64);
+    if (list) subscribed[id / 64].fetch_or(bit, std::memory_order_relaxed);
+    else subscribed[id / 64].fetch_and(~bit, std::memory_order_relaxed);
+
+    if (old)
+    {
+        retired.emplace_back(old, 
+            handler_epoch.fetch_add(1, std::memory_order_seq_cst) + 1);
+        retired_count.store(retired.size(), std::memory_order_relaxed);
+    }
+}
+
+void EventProcessor::reclaim_handlers()
+{
+    uint64_t epoch = dispatch_epoch.load(std::memory_order_seq_cst);
+
+    std::erase_if(retired, [epoch](const std::pair<HandlerList*, uint64_t>& x) {
+        // The dispatching thread entered after the list was replaced, so it loaded the new one
+        bool unused = epoch == 0 || epoch >= x.second;
+        if (unused) delete x.first;
+        return unused;
+    });
+    retired_count.store(retired.size(), std::memory_order_relaxed);
+}
+
+HandlerList* EventProcessor::rebuild_handlers(size_t id, size_t extra)
+{
+    HandlerList* old = handlers[id].load(std::memory_order_relaxed);
+    size_t live = old ? old->live() : 0;
+
+    if (live + extra == 0)
+    {
+        replace_handlers(id, nullptr);
+        return nullptr;
+    }
+
+    auto list = new HandlerList(std::max<size_t>(4, (live + extra) * 2));
+    size_t position = 0;
+    if (old)
+    {
+        for (size_t i = 0; i < old->size.load(std::memory_order_relaxed); i++)
+        {
+            if (!old->slots[i].active.load(std::memory_order_relaxed)) continue;
+
+            auto& slot = list->slots[position];
+            slot.entry = old->slots[i].entry;
+            slot.active.store(true, std::memory_order_relaxed);
+            slot.subscription = old->slots[i].subscription;
+#ifdef EVENT_PROFILE_HANDLERS
+            // Calls the dispatching thread makes on the old list from here on are not carried over
+            auto& profile = old->slots[i].profile;
+            slot.profile.calls.set(profile.calls.get());
+            slot.profile.sampled_calls.set(profile.sampled_calls.get());
+            slot.profile.sampled_ns.set(profile.sampled_ns.get());
+            slot.profile.max_ns.set(profile.max_ns.get());
+#endif
+            subscriptions[slot.subscription].position = position++;
+        }
+    }
+    list->size.store(position, std::memory_order_relaxed);
+
+    replace_handlers(id, list);
+    return list;
+}
+
+void EventProcessor::remove_slot(HandlerList* list, size_t position)
+{
+    auto& slot = list->slots[position];
+    slot.active.store(false, std::memory_order_release);
+    list->removed++;
+
+    auto& subscription = subscriptions[slot.subscription];
+    subscription.used = false;
+    subscription.generation++;
+    free_subscriptions.push_back(slot.subscription);
+}
+
+SubscriptionHandle EventProcessor::add_handler(size_t id, const HandlerEntry& entry)
+{
+    std::unique_lock lock(subscribe_mutex);
+
+    uint32_t index;
+    if (free_subscriptions.empty())
+    {
+        index = (uint32_t) subscriptions.size();
+        subscriptions.emplace_back();
+    }
+    else 
+    {
+        index = free_subscriptions.back();
+        free_subscriptions.pop_back();
+    }
+
+    HandlerList* list = handlers[id].load(std::memory_order_relaxed);
+    if (!list || list->size.load(std::memory_order_relaxed) == list->capacity)
+    {
+        list = rebuild_handlers(id, 1);
+    }
+
+    size_t position = list->size.load(std::memory_order_relaxed);
+    auto& slot = list->slots[position];
+    slot.entry = entry;
+    slot.active.store(true, std::memory_order_relaxed);
+    slot.subscription = index;
+    list->size.store(position + 1, std::memory_order_release);
+
+    auto& subscription = subscriptions[index];
+    subscription.event_id = id;
+    subscription.position = position;
+    subscription.used = true;
+
+    reclaim_handlers();
+    return { id, index, subscription.generation };
+}
+
+bool EventProcessor::unsubscribe(const SubscriptionHandle& handle)
+{
+    std::unique_lock lock(subscribe_mutex);
+
+    if (handle.slot >= subscriptions.size()) return false;
+    auto& subscription = subscriptions[handle.slot];
+    if (!subscription.used || subscription.generation != handle.generation) return false;
+
+    size_t id = subscription.event_id;
+    HandlerList* list = handlers[id].load(std::memory_order_relaxed);
+    remove_slot(list, subscription.position);
+
+    // Compacting only once more are removed than live keeps it constant time amortized
+    if (list->removed > list->live()) rebuild_handlers(id, 0);
+
+    reclaim_handlers();
+    return true;
+}
+
+void EventProcessor::remove_handlers(void* instance)
+{
+    std::unique_lock lock(subscribe_mutex);
+
+    for (size_t id = 0; id < max_event_types; id++)
+    {
+        HandlerList* list = handlers[id].load(std::memory_order_relaxed);
+        if (!list) continue;
+
+        for (size_t i = 0; i < list->size.load(std::memory_order_relaxed); i++)
+        {
+            auto& slot = list->slots[i];
+            if (slot.active.load(std::memory_order_relaxed) && slot.entry.instance == instance)
+            {
+                remove_slot(list, i);
+            }
+        }
+
+        if (list->removed > list->live()) rebuild_handlers(id, 0);
+    }
+
+    reclaim_handlers();
+}
+
+void EventProcessor::process_events()
+{
+    resume_posted();
+
+    for (BatchEntry entry; events_queue.pop(entry); )
+    {
+        EventBatch* batch = entry.batch;
+        Event* const* events = entry.events;
+        size_t events_size = entry.size;
+
+#ifdef EVENT_STATS
+        Timer<std::chrono::steady_clock> stats_timer;
+        stat_dispatch_start = stats_now_ns();
+        // dispatch_records counts the records it dispatches, the other paths dispatch every entry
+        stat_batch_events = batch->has_values() ? 0 : events_size;
+#endif
+
+        // Entered per batch so lists replaced during a long drain can be freed between batches
+        enter_dispatch();
+
+        if (batch->has_values())
+        {
+            dispatch_records(batch);
+        }
+        else if (dispatch_mode == DispatchMode::by_type)
+        {
+            dispatch_by_type(events, events_size);
+        }
+        else 
+        {
+            for (size_t i = 0; i < events_size; i++)
+            {
+                // The id is in the event header, pulling the next headers in hides the pointer chase
+                if (i + prefetch_distance < events_size) 
+                    EVENT_PREFETCH(events[i + prefetch_distance]);
+
+                Event* event = events[i]; 
+#ifdef EVENT_STATS
+                record_latency(event);
+#endif
+                size_t id = event->find_type_id();
+                uint64_t registrations = awaits_registered();
+                HandlerList* list = get_handlers(id);
+                if (list)
+                {
+                    list->for_each([event](const HandlerSlot& handler) {
+                        handler.exec(event);
+                    });
+                }
+                maybe_resume_awaiting(id, event, registrations);
+            }
+        }
+
+        batch->release();
+        resume_posted();
+
+#ifdef EVENT_STATS
+        stat_dispatch_ns.add(stats_timer.get_time_ns().count());
+        stat_events_dispatched.add(stat_batch_events);
+        stat_batches_dispatched.add(1);
+#endif
+    }
+
+    exit_dispatch();
+}
+
+void EventProcessor::dispatch_records(EventBatch* batch)
+{
+    // Value events are read in place, only the Event* records still point somewhere else
+    const EventProcessor* const* owners = batch->record_owners();
+    size_t index = 0;
+    for (ValueRecord* record = batch->records(), *end = batch->records_end(); record != end; record = record->next())
+    {
+        // Partitioned to another processor
+        if (owners && owners[index] && owners[index] != this) 
+        {
+            index++;
+            continue;
+        }
+        index++;
+#ifdef EVENT_STATS
+        stat_batch_events++;
+#endif
+
+        void* event = record->data();
+        size_t id = record->id;
+        if (id == ValueRecord::pointer_record)
+        {
+            Event* pointer = *static_cast<Event**>(event);
+#ifdef EVENT_STATS
+            record_latency(pointer);
+#endif
+            id = pointer->find_type_id();
+            event = pointer;
+        }
+
+        uint64_t registrations = awaits_registered();
+        HandlerList* list = get_handlers(id);
+        if (list)
+        {
+            list->for_each([event](const HandlerSlot& handler) {
+                handler.exec(event);
+            });
+        }
+        maybe_resume_awaiting(id, event, registrations);
+    }
+}
+
+void EventProcessor::dispatch_by_type(
+    Event* const* events, size_t num_events)
+{
+    // One pass over the event headers, events nobody handles are dropped here
+    by_type_input.clear();
+    for (size_t i = 0; i < num_events; i++)
+    {
+        Event* event = events[i];
+#ifdef EVENT_STATS
+        record_latency(event);
+#endif
+        size_t id = event->find_type_id();
+        if (get_handlers(id) || awaiting_count.load(std::memory_order_relaxed) != 0) by_type_input.emplace_back(event, id);
+    }
+
+    by_type_output.resize(by_type_input.size());
+    by_type_count.resize(max_event_types);
+    count_sort_by(by_type_input.data(), by_type_output.data(), by_type_input.size(), 
+        by_type_count.data(), max_event_types, 
+        [](const std::pair<Event*, size_t>& x) { return x.second; });
+
+    for (size_t begin = 0, end; begin < by_type_output.size(); begin = end)
+    {
+        size_t id = by_type_output[begin].second;
+        for (end = begin + 1; end < by_type_output.size() && 
+            by_type_output[end].second == id; end++);
+
+        // Coroutines the handlers of the run start waiting get the events of a later run
+        uint64_t registrations = awaits_registered();
+
+        // May have been unsubscribed since the first pass
+        HandlerList* list = get_handlers(id);
+        if (list)
+        {
+            list->for_each([&](const HandlerSlot& handler) {
+                for (size_t i = begin; i < end; i++)
+                {
+                    handler.exec(by_type_output[i].first);
+                }
+            });
+        }
+
+        // After every handler of the run, like the handlers the coroutines see the run in order
+        for (size_t i = begin; i < end; i++)
+        {
+            maybe_resume_awaiting(id, by_type_output[i].first, registrations);
+        }
+    }
+}
+
+void EventProcessor::add_events(EventBatch* events)
+{
+    add_events(events, events->data(), events->size());
+}
+
+void EventProcessor::add_events(EventBatch* batch, Event* const* events, size_t n)
+{
+    events_queue.push({ batch, events, n }); 
+    notify_waiters();
+}
+
+void EventProcessor::notify_waiters()
+{
+    // Pairs with the fence in wait_for_events, either the waiter sees the batch or this sees the waiter
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) != 0)
+    {
+        std::lock_guard lock(wait_mutex);
+        wait_cv.notify_one();
+    }
+}
+
+bool EventProcessor::wait_for_events(std::chrono::nanoseconds timeout)
+{
+    auto ready = [this] { return events_queue.size_approx() != 0 || posted.size_approx() != 0; };
+    if (ready()) return true;
+
+    std::unique_lock lock(wait_mutex);
+    waiters.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    bool woken = wait_cv.wait_for(lock, timeout, ready);
+
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+    return woken;
+}
+
+void EventProcessor::await_event(size_t id, std::coroutine_handle<> handle, void** event)
+{
+    std::lock_guard lock(await_mutex);
+    awaiting.push_back({ id, handle, event, await_registrations.fetch_add(1, std::memory_order_relaxed) });
+    awaited[id / 64].fetch_or(uint64_t(1) << (id % 64), std::memory_order_relaxed);
+    awaiting_count.store(awaiting.size(), std::memory_order_relaxed);
+}
+
+void EventProcessor::resume_awaiting(size_t id, void* event, uint64_t registrations)
+{
+    if (!(awaited[id / 64].load(std::memory_order_relaxed) >> (id % 64) & 1)) return;
+
+    // Taken out first, resumed coroutines can await again and that is for a later event
+    {
+        std::lock_guard lock(await_mutex);
+        resuming.clear();
+        auto kept = std::stable_partition(awaiting.begin(), awaiting.end(), 
+            [id, registrations](const AwaitingEvent& waiting) 
+            { 
+                return waiting.id != id || waiting.registration >= registrations; 
+            });
+        std::move(kept, awaiting.end(), std::back_inserter(resuming));
+        awaiting.erase(kept, awaiting.end());
+
+        // The bit stays while coroutines started by this event's handlers wait for the next one
+        bool still_awaited = std::any_of(awaiting.begin(), awaiting.end(), 
+            [id](const AwaitingEvent& waiting) { return waiting.id == id; });
+        if (!still_awaited) awaited[id / 64].fetch_and(~(uint64_t(1) << (id % 64)), std::memory_order_relaxed);
+        awaiting_count.store(awaiting.size(), std::memory_order_relaxed);
+    }
+
+    // In the order they started waiting
+    for (auto& waiting : resuming)
+    {
+        *waiting.event = event;
+        waiting.handle.resume();
+    }
+}
+
+void EventProcessor::post(std::coroutine_handle<> handle)
+{
+    posted.enqueue(handle);
+    notify_waiters();
+}
+
+void EventProcessor::resume_posted()
+{
+    // Only the ones posted so far, a coroutine that posts itself again waits for the next call
+    std::coroutine_handle<> handle;
+    for (size_t budget = posted.size_approx(); budget && posted.try_dequeue(handle); budget--)
+    {
+        handle.resume();
+    }
+}
+
+#ifdef EVENT_PROFILE_HANDLERS
+void EventProcessor::get_handler_profile(std::vector<HandlerProfileStats>& output)
+{
+    // Lists are only retired and freed under subscribe_mutex
+    std::lock_guard lock(subscribe_mutex);
+    for (size_t id = 0; id < max_event_types; id++)
+    {
+        HandlerList* list = handlers[id].load(std::memory_order_relaxed);
+        if (!list) continue;
+
+        for (size_t i = 0; i < list->size.load(std::memory_order_relaxed); i++)
+        {
+            auto& slot = list->slots[i];
+            if (!slot.active.load(std::memory_order_relaxed)) continue;
+
+            HandlerProfileStats stats;
+            stats.event_id = id;
+            stats.instance = slot.entry.instance;
+            stats.calls = slot.profile.calls.get();
+            stats.sampled_calls = slot.profile.sampled_calls.get();
+            stats.sampled_ns = slot.profile.sampled_ns.get();
+            stats.max_ns = slot.profile.max_ns.get();
+            output.push_back(stats);
+        }
+    }
+}
+#endif
+
+#ifdef EVENT_STATS
+ProcessorStats EventProcessor::get_stats() const
+{
+    ProcessorStats rval;
+    rval.batches_dispatched = stat_batches_dispatched.get();
+    rval.events_dispatched = stat_events_dispatched.get();
+    rval.dispatch_ns = stat_dispatch_ns.get();
+    rval.latency_ns = stat_latency_ns.snapshot();
+    // From the ring, dropped batches leave it without being dispatched
+    rval.queue_depth = events_queue.size_approx();
+    return rval;
+}
+#endif
+
+#endif
+
+// Member function traits for StaticEventProcessor, which takes events of any type instead of only Event subclasses
+template <auto MemFun>
+struct static_member_handler;
+
+template <typename T, typename E, void (T::*MemFun)(E*)>
+struct static_member_handler<MemFun>
+{
+    using handler_type = T;
+    using event_type = E;
+};
+
+// Handler set fixed at compile time, a visitor for the Visitor overloads of StaticEventProcessor
+// ie process_events(StaticHandlers<&Book::on_tick, &Risk::on_fill>(&book, &risk))
+// The handlers of an event type are called in the order given and every call is inlined into the visit
+template <auto... MemFuns>
+class StaticHandlers
+{
+private:
+    std::tuple<typename static_member_handler<MemFuns>::handler_type*...> instances;
+
+    template <auto MemFun, typename T, typename E>
+    static inline void call(T* instance, E& event)
+    {
+        if constexpr (std::is_same_v<typename static_member_handler<MemFun>::event_type, E>) (instance->*MemFun)(&event);
+    }
+public:
+    explicit StaticHandlers(typename static_member_handler<MemFuns>::handler_type*... instances) 
+        : instances(instances...) {}
+
+    // Events without a handler here are skipped
+    template <typename E>
+    inline void operator()(E& event) const
+    {
+        std::apply([&event](auto*... instance) { (call<MemFuns>(instance, event), ...); }, instances);
+    }
+};
+
+// Processor for a closed set of event types known at compile time, ie StaticEventProcessor<Tick, Order, Fill>
+// Events are stored by value in a std::variant and each type has its own handler vector, so dispatch is a switch 
+// on the variant index with no ids, virtual calls or lookups by id. Subscribed handlers are still called through 
+// one function pointer each, pass a StaticHandlers or another visitor to process to have the calls inlined
+// Events do not have to derive from Event, events submitted by one thread are handled in the order they were submitted
+// A thread that builds its own batches can skip the queue, which costs more than dispatch itself, with process
+template <typename... Events>
+class StaticEventProcessor
+{
+public:
+    using event_type = std::variant<Events...>;
+private:
+    static_assert(sizeof...(Events) > 0);
+
+    template <typename E>
+    struct Handler
+    {
+        void* instance;
+        void (*call)(void* instance, E* event);
+    };
+
+    std::tuple<std::vector<Handler<Events>>...> handlers;
+
+    moodycamel::ConcurrentQueue<event_type> queue;
+
+    // Reused by process_events
+    std::vector<event_type> dequeued;
+
+    template <auto MemFun>
+    static void trampoline(void* instance, typename static_member_handler<MemFun>::event_type* event)
+    {
+        (static_cast<typename static_member_handler<MemFun>::handler_type*>(instance)->*MemFun)(event);
+    }
+
+    template <typename E>
+    inline void call_handlers(E& event) const
+    {
+        for (const auto& handler : std::get<std::vector<Handler<E>>>(handlers))
+        {
+            handler.call(handler.instance, &event);
+        }
+    }
+
+    template <typename F>
+    size_t drain(F&& fun)
+    {
+        dequeued.clear();
+        queue.try_dequeue_bulk(std::back_inserter(dequeued), queue.size_approx());
+        fun(dequeued.data(), dequeued.size());
+
+        size_t got = dequeued.size();
+        dequeued.clear();
+        return got;
+    }
+public:
+    template <typename E>
+    static constexpr bool handles = (std::is_same_v<E, Events> || ...);
+
+    StaticEventProcessor() = default;
+
+    StaticEventProcessor(const StaticEventProcessor& other) = delete;
+    StaticEventProcessor& operator=(const StaticEventProcessor& other) = delete;
+
+    // Faster submits for a thread that submits often, each thread needs its own
+    inline moodycamel::ProducerToken make_producer() { return moodycamel::ProducerToken(queue); }
+
+    // Adds a handler, ie subscribe<&T::on_tick>(handler), the call is inlined into its trampoline, which 
+    // process calls through a function pointer
+    // Nocall: process_events
+    template <auto MemFun>
+    inline void subscribe(typename static_member_handler<MemFun>::handler_type* handler)
+    {
+        using E = typename static_member_handler<MemFun>::event_type;
+        static_assert(handles<E>, "the processor was not declared with this event type");
+
+        std::get<std::vector<Handler<E>>>(handlers).push_back({ handler, &trampoline<MemFun> });
+    }
+
+    // Removes every handler of an instance
+    // Nocall: process_events
+    template <typename T>
+    inline void unsubscribe(T* handler)
+    {
+        std::apply([handler](auto&... lists) {
+            (std::erase_if(lists, [handler](const auto& entry) { return entry.instance == handler; }), ...);
+        }, handlers);
+    }
+
+    // Thread safe, copies or moves the event into the queue
+    template <typename E>
+    inline void submit(E&& event)
+    {
+        static_assert(handles<std::decay_t<E>>, "the processor was not declared with this event type");
+        queue.enqueue(event_type(std::in_place_type<std::decay_t<E>>, std::forward<E>(event)));
+    }
+
+    template <typename E>
+    inline void submit(moodycamel::ProducerToken& producer, E&& event)
+    {
+        static_assert(handles<std::decay_t<E>>, "the processor was not declared with this event type");
+        queue.enqueue(producer, event_type(std::in_place_type<std::decay_t<E>>, std::forward<E>(event)));
+    }
+
+    // Calls the subscribed handlers of n events in order
+    // Nocall: subscribe and unsubscribe
+    inline void process(event_type* events, size_t n) const
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            std::visit([this](auto& event) { call_handlers(event); }, events[i]);
+        }
+    }
+
+    // Calls visitor(event) for n events instead of the subscribed handlers, the visitor needs an overload for 
+    // every event type and is inlined into the switch
+    template <typename Visitor>
+    static inline void process(event_type* events, size_t n, Visitor&& visitor)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            std::visit(visitor, events[i]);
+        }
+    }
+
+    // Same as process for every event waiting in the queue, returns how many events were processed
+    // Nocall: process_events, subscribe and unsubscribe
+    inline size_t process_events()
+    {
+        return drain([this](event_type* events, size_t n) { process(events, n); });
+    }
+
+    template <typename Visitor>
+    inline size_t process_events(Visitor&& visitor)
+    {
+        return drain([&visitor](event_type* events, size_t n) { process(events, n, visitor); });
+    }
+};
+
+// How move_to_processors rebuilds the submission order of a batch
+enum class EventOrdering
+{
+    // Writes every event to its offset from the smallest sequence number in the batch, O(n) since sequence numbers are dense
+    // Falls back to radix when a batch is too sparse (ie a straggler from a much older submit)
+    scatter,
+    // Radix sorts the sequence numbers
+    radix,
+    // No global sequence number is taken in submit and nothing is sorted, events are only ordered relative to 
+    // other events submitted through the same processor. Event* and value events go through different queues, 
+    // so a batch holds the Event* events of a producer before its value events and mixing the two kinds loses 
+    // their order
+    per_producer
+};
+
+// Gets every batch move_to_processors makes, in order, before any processor does, ie EventJournal in event_journal.h
+// Called on the thread moving events, which may be the pump thread, so a sink that can fail keeps the error itself
+class BatchSink
+{
+public:
+    virtual ~BatchSink() = default;
+    virtual void write(EventBatch& batch) noexcept = 0;
+};
+
+struct EventManagerOptions
+{
+    EventOrdering ordering = EventOrdering::scatter;
+
+    // Threads used to sort batches in move_to_processors and to run process_all, including the thread calling them
+    size_t worker_threads = std::thread::hardware_concurrency();
+
+    // Batches smaller than this are sorted on the calling thread since the fan out costs more than the sort
+    size_t sequential_sort_threshold = 1 << 15;
+
+    // Radix sorts 8 byte (offset, index) keys instead of (Event*, sequence) pairs when a batch's sequence numbers 
+    // span less than 2^32, halving the data moved by each pass at the cost of a random gather at the end
+    bool compact_sort_keys = false;
+
+    // Batches each processor can have waiting before backpressure applies
+    size_t processor_queue_capacity = 64;
+    Backpressure backpressure = Backpressure::grow;
+
+    // Hands each processor only the events it has handlers for and skips processors with none in a batch, 
+    // instead of every processor scanning every batch. Events moved before a subscribe are not seen by it 
+    // Batches with value events are only skipped or handed over whole
+    bool route_by_subscription = false;
+
+    // With processors on more than one NUMA node, batches with value events of at least this many bytes are 
+    // copied to each node so handlers read their records locally. SIZE_MAX turns the copies off
+    size_t numa_replica_min_bytes = 1 << 14;
+
+    // Not owned, has to outlive the manager
+    BatchSink* journal = nullptr;
+
+    // Starts a thread that calls move_to_processors once pump_batch_size events are waiting or pump_latency after 
+    // the first waiting event was seen. With per_producer ordering there is no event count to watch, so the pump 
+    // checks the queue every pump_latency instead
+    bool pump = false;
+    size_t pump_batch_size = 4096;
+    std::chrono::microseconds pump_latency{ 200 };
+};
+
+// Nocall are methods that cannot be called at the same time as the method being called
+class MultiEventManager
+{
+private:
+    EventManagerOptions options;
+    ThreadPool worker_pool;
+
+    // The number of created processor 
+    // Recyclable processors? using queue 
+    size_t subtracted = 0;
+    std::atomic<size_t> event_count = 0;
+
+    // Value event copied by submit_value, takes its sequence number from event_count as well
+    struct ValueCell
+    {
+        size_t sequence;
+        uint32_t id;
+        uint32_t size;
+        alignas(8) unsigned char data[max_value_event_size];
+    };
+
+    // Reused by move_to_processors
+    std::vector<std::pair<Event*, size_t>> dequeued;
+    std::vector<ValueCell> dequeued_values;
+    // Dequeued with a sequence number past the count move_to_processors started from, an event stamped before 
+    // them may still be in the other queue, so they wait for the next move
+    std::vector<std::pair<Event*, size_t>> carried;
+    std::vector<ValueCell> carried_values;
+    // Both kinds of event as tagged addresses, value cells have the low bit set
+    std::vector<std::pair<uintptr_t, size_t>> dequeued_mixed;
+    std::vector<uintptr_t> ordered_mixed;
+
+    // Event queue
+    // Declared before the processors since their producer tokens and arenas point into these 
+    moodycamel::ConcurrentQueue<std::pair<Event*, size_t>> event_queue;
+    moodycamel::ConcurrentQueue<ValueCell> value_queue;
+    EventArenaPool arena_pool;
+    // Arenas of processors placed on a node, by node
+    std::vector<std::unique_ptr<EventArenaPool>> numa_arena_pools;
+
+    // Same index as processors
+    std::vector<std::unique_ptr<moodycamel::ProducerToken>> value_producers;
+
+    // Orders a batch holding value events, both kinds are ordered together and written as records
+    // Adds carried to got, then moves every element of got stamped at or after snapshot to carried
+    template <typename T, typename SequenceOf>
+    static void carry_after(std::vector<T>& got, std::vector<T>& carried, size_t snapshot, SequenceOf sequence_of)
+    {
+        got.insert(got.end(), carried.begin(), carried.end());
+        carried.clear();
+
+        size_t kept = 0;
+        for (size_t i = 0; i < got.size(); i++)
+        {
+            if (sequence_of(got[i]) >= snapshot) carried.push_back(got[i]);
+            else if (kept++ != i) got[kept - 1] = got[i];
+        }
+        got.resize(kept);
+    }
+
+    EventBatch* order_with_values(size_t values_got);
+
+    // Reused by hand_out, a route is the group of a processor or none or all
+    std::vector<uint64_t> present_ids;
+    std::vector<uint32_t> batch_ids;
+    std::vector<uint64_t> route_mask;
+    std::vector<uint64_t> group_masks;
+    std::vector<size_t> routes;
+    std::vector<std::vector<Event*>> routed;
+    std::vector<Event* const*> group_starts;
+
+    struct Partition
+    {
+        std::vector<size_t> processor_ids;
+        std::function<size_t(void*)> hash;
+
+        // Spread first, std::hash of an integer is the integer
+        inline size_t owner(void* event) const 
+        { 
+            return processor_ids[((uint64_t) hash(event) * 0x9E3779B97F4A7C15ull >> 32) % processor_ids.size()]; 
+        }
+    };
+
+    // One per event id, set by partition
+    std::vector<std::unique_ptr<Partition>> partitions = std::vector<std::unique_ptr<Partition>>(max_event_types);
+    std::vector<uint64_t> partitioned_ids = std::vector<uint64_t>(EventProcessor::subscription_mask_words());
+    std::vector<uint64_t> processor_takes;
+
+    // Keys of one type seen by the current conflate_batch pass, which goes from the back of the batch
+    struct Conflation
+    {
+        std::function<bool(void*)> seen_before;
+        std::function<void()> reset;
+        bool touched = false;
+    };
+
+    // One per event id, set by conflate
+    std::vector<std::unique_ptr<Conflation>> conflations = std::vector<std::unique_ptr<Conflation>>(max_event_types);
+    std::vector<uint64_t> conflated_ids = std::vector<uint64_t>(EventProcessor::subscription_mask_words());
+    bool any_conflations = false;
+
+    // Reused by conflate_batch
+    std::vector<uint8_t> conflate_keep;
+    std::vector<ValueRecord*> conflate_records;
+    std::vector<Event*> conflate_dropped;
+    std::vector<size_t> conflate_touched;
+
+    // Drops every conflated event that has a later one with the same key in the batch, before anyone sees it
+    void conflate_batch(EventBatch* batch);
+
+    // Gives the batch to the processors, routed by their subscriptions with options.route_by_subscription
+    void hand_out(EventBatch* batch);
+    void route_batch(EventBatch* batch);
+
+    // route_batch for a batch holding partitioned events, present_ids and batch_ids are filled in
+    void hand_out_partitioned(EventBatch* batch);
+
+    // Set in get_processor once processors were placed on more than one node
+    bool numa_spread = false;
+    // Per node, made by local_batch for the batch being handed out
+    std::vector<EventBatch*> node_replicas;
+    bool replicate = false;
+    int move_node = -1;
+
+    // The batch or its replica on the node of processor p, takes over the reference acquired for p on batch
+    inline EventBatch* local_batch(EventBatch* batch, size_t p)
+    {
+        int node = processors[p]->get_numa_node();
+        if (!replicate || node < 0 || node == move_node) return batch;
+
+        EventBatch*& replica = node_replicas[node];
+        if (!replica) replica = EventBatch::create_replica(batch, node);
+        replica->acquire();
+        batch->release();
+        return replica;
+    }
+
+    std::vector<std::unique_ptr<EventProcessor>> processors;
+
+    // Guards the processors vector, subscriptions only take it shared since processors handle their own 
+    std::shared_mutex processor_and_sub;
+    // hand_out's scratch is shared by move_to_processors and add_batch
+    std::mutex hand_out_mutex;
+
+    // Submits that bring the event count past pump_notify_at wake the pump, SIZE_MAX when it is not waiting on one
+    std::atomic<size_t> pump_notify_at = SIZE_MAX;
+    std::mutex pump_mutex;
+    std::condition_variable pump_wake;
+    bool pump_stopping = false;
+    std::thread pump_thread;
+
+    void pump_loop();
+
+#ifdef EVENT_STATS
+    // Written by the thread calling move_to_processors
+    StatCounter stat_events_moved;
+    StatCounter stat_events_conflated;
+    StatCounter stat_batches_moved;
+    StatCounter stat_copy_ns;
+    StatCounter stat_sort_ns;
+    StatHistogram stat_batch_sizes;
+#endif
+
+    inline void notify_pump(size_t sequence_end)
+    {
+        // Only the submit that clears the value it compared against wakes the pump
+        size_t notify_at = pump_notify_at.load();
+        if (sequence_end > notify_at && pump_notify_at.compare_exchange_strong(notify_at, SIZE_MAX))
+        {
+            std::lock_guard lock(pump_mutex);
+            pump_wake.notify_one();
+        }
+    }
+public:
+    MultiEventManager(const EventManagerOptions& options = {})
+        : options(options), worker_pool(options.worker_threads) 
+    {
+        if (options.pump) pump_thread = std::thread(&MultiEventManager::pump_loop, this);
+    }
+    ~MultiEventManager();
+
+    MultiEventManager(const MultiEventManager& other) = delete;
+    MultiEventManager& operator=(const MultiEventManager& other) = delete;
+
+    // Creates a new processor which can be used to run processes on different threads (ie processes that use processors are thread safe)
+    // numa_node is where the thread using the processor runs, see pin_thread_to_numa_node. Its arena is allocated 
+    // there, and batches with value events get a copy on every node processors are placed on
+    size_t get_processor(int numa_node = -1); 
+
+    inline int get_numa_node(size_t processor_id) 
+    { 
+        std::shared_lock lock(processor_and_sub);
+        return processors[processor_id]->get_numa_node(); 
+    }
+    
+    // Adds a handler to a processor, the handle can be used to remove just this subscription
+    template <typename T, HandledEvent E>
+    inline SubscriptionHandle subscribe(size_t processor_id, T* handler, 
+        handler_fun_t<T, E> handler_fun)
+    {
+        std::shared_lock lock(processor_and_sub);
+        return processors[processor_id]->subscribe(handler, handler_fun);
+    }
+
+    // Adds a handler whose member function is known at compile time, ie subscribe<&T::on_event>(processor_id, handler)
+    // The call gets inlined into the dispatch trampoline
+    template <auto MemFun>
+    inline SubscriptionHandle subscribe(size_t processor_id, 
+        typename member_handler<MemFun>::handler_type* handler)
+    {
+        std::shared_lock lock(processor_and_sub);
+        return processors[processor_id]->template subscribe<MemFun>(handler);
+    }
+
+    // Removes a handler from a processor
+    template <typename T>
+    inline void unsubscribe(size_t processor_id, T* handler)
+    {   
+        std::shared_lock lock(processor_and_sub);
+        processors[processor_id]->unsubscribe(handler);
+    }
+
+    // Removes the subscription a handle came from in constant time, returns false if it was already removed
+    inline bool unsubscribe(size_t processor_id, const SubscriptionHandle& handle)
+    {   
+        std::shared_lock lock(processor_and_sub);
+        return processors[processor_id]->unsubscribe(handle);
+    }
+
+    // Creates an event in the arena of a processor, the memory is reused once every processor has processed the 
+    // batch it ended up in instead of being freed one event at a time
+    // Same rules as submit, only the thread submitting through processor_id may use it
+    template <ValidEvent E, typename... Args>
+    inline E* emplace(size_t processor_id, Args&&... args)
+    {
+        return processors[processor_id]->get_arena().template emplace<E>(
+            std::forward<Args>(args)...);
+    }
+
+    // Add an event that will be processed by every processor
+    // Should be destroyed after it is processed by every processor 
+    // This is the processor it is being submitted by, not the processor it will appear on (it will appear on all processors)
+    // Very thread safe (can be used with any method besides get_processor)
+    void submit(size_t processor_id, Event* event);
+
+    // Same as submit for n events, takes all n sequence numbers at once and enqueues them in one go 
+    // The events keep their order relative to each other
+    void submit_bulk(size_t processor_id, Event** events, size_t n);
+
+    // Copies a small trivially copyable event into the pipeline, it is ordered with the Event* submits and 
+    // handlers get a pointer into the batch, so dispatch reads these events sequentially
+    // Same rules as submit
+    template <ValueEvent E>
+    inline void submit_value(size_t processor_id, const E& event)
+    {
+        ValueCell cell;
+        cell.id = (uint32_t) E::id;
+        cell.size = (uint32_t) sizeof(E);
+        memcpy(cell.data, &event, sizeof(E));
+        cell.sequence = options.ordering == EventOrdering::per_producer 
+            ? 0 : event_count.fetch_add(1);
+
+        value_queue.enqueue(*value_producers[processor_id], cell);
+
+        if (options.pump) notify_pump(cell.sequence + 1);
+    }
+
+    // Hands every E to one of processor_ids instead of every processor, picked by a hash of key_of(const E&)
+    // Events with the same key go to the same processor in the order they were submitted
+    // An empty processor_ids goes back to handing E to every processor
+    // Throws std::out_of_range when an id is not a processor, the partition is left as it was
+    // Waits for a running pump's move. Nocall: move_to_processors
+    template <HandledEvent E, typename KeyOf>
+    void partition(std::vector<size_t> processor_ids, KeyOf key_of)
+    {
+        using Key = std::decay_t<std::invoke_result_t<KeyOf&, const E&>>;
+
+        std::unique_lock lock(processor_and_sub);
+        for (size_t id : processor_ids)
+        {
+            if (id >= processors.size()) throw std::out_of_range("partition to a processor that does not exist");
+        }
+
+        uint64_t bit = uint64_t(1) << (E::id % 64);
+        if (processor_ids.empty())
+        {
+            partitions[E::id].reset();
+            partitioned_ids[E::id / 64] &= ~bit;
+            return;
+        }
+
+        partitions[E::id] = std::make_unique<Partition>(Partition{ std::move(processor_ids), 
+            [key_of = std::move(key_of)](void* event) { 
+                return std::hash<Key>{}(key_of(*event_cast<E>(event))); 
+            } });
+        partitioned_ids[E::id / 64] |= bit;
+    }
+
+    // Keeps only the last E for each key_of(const E&) in a batch, the earlier ones are released before any 
+    // processor sees them. The kept event stays where it is in the batch. The key needs std::hash and ==
+    // Waits for a running pump's move. Nocall: move_to_processors
+    template <HandledEvent E, typename KeyOf>
+    void conflate(KeyOf key_of)
+    {
+        using Key = std::decay_t<std::invoke_result_t<KeyOf&, const E&>>;
+        auto seen = std::make_shared<std::unordered_set<Key>>();
+
+        std::unique_lock lock(processor_and_sub);
+        conflations[E::id] = std::make_unique<Conflation>(Conflation{ 
+            [seen, key_of = std::move(key_of)](void* event) { 
+                return !seen->insert(key_of(*event_cast<E>(event))).second; 
+            },
+            [seen] { seen->clear(); } });
+        conflated_ids[E::id / 64] |= uint64_t(1) << (E::id % 64);
+        any_conflations = true;
+    }
+
+    // Delivers every E again
+    template <HandledEvent E>
+    void stop_conflating()
+    {
+        std::unique_lock lock(processor_and_sub);
+        conflations[E::id].reset();
+        conflated_ids[E::id / 64] &= ~(uint64_t(1) << (E::id % 64));
+        any_conflations = std::any_of(conflated_ids.begin(), conflated_ids.end(), 
+            [](uint64_t word) { return word != 0; });
+    }
+
+    // Changes how a processor walks through its batches, see DispatchMode
+    // Nocall: process_events on the same processor
+    inline void set_dispatch_mode(size_t processor_id, DispatchMode mode)
+    {
+        std::shared_lock lock(processor_and_sub);
+        processors[processor_id]->set_dispatch_mode(mode);
+    }
+
+    // Suspends a coroutine until the next E is dispatched on a processor, ie Tick* tick = co_await manager.next<Tick>(id)
+    // It is resumed by process_events right after the handlers of that event, so it runs on the processor's thread 
+    // and the event is only valid until the coroutine suspends again. Coroutines still waiting are destroyed with 
+    // the manager. Very thread safe
+    template <HandledEvent E>
+    inline NextEvent<E> next(size_t processor_id)
+    {
+        std::shared_lock lock(processor_and_sub);
+        return NextEvent<E>(processors[processor_id].get());
+    }
+
+    // Continues a coroutine inside process_events of a processor, ie co_await manager.resume_on(id) after I/O 
+    // completed on another thread. Very thread safe
+    inline ResumeOn resume_on(size_t processor_id)
+    {
+        std::shared_lock lock(processor_and_sub);
+        return ResumeOn(processors[processor_id].get());
+    }
+
+    // Same as resume_on for a coroutine that is already suspended, ie from an I/O completion callback
+    inline void post(size_t processor_id, std::coroutine_handle<> handle)
+    {
+        std::shared_lock lock(processor_and_sub);
+        processors[processor_id]->post(handle);
+    }
+
+    // Process every event using a certain processor
+    // Thread safe only with submit
+    void process_events(size_t processor_id);
+
+    // Parks the thread until a batch reaches the processor or timeout passes, then processes every waiting batch 
+    // Returns false if it timed out with nothing to process
+    // Same rules as process_events
+    bool wait_and_process(size_t processor_id, std::chrono::nanoseconds timeout);
+
+    // Processes every processor on pool with one task per processor, returns once every batch moved so far 
+    // has been processed everywhere
+    // Nocall: process_events, and move_to_processors (or a running pump) when using the manager's own pool
+    void process_all(ThreadPool& pool);
+    inline void process_all() { process_all(worker_pool); }
+
+    // Takes events and moves them onto the processors so they can efficiently process events and properly delete them 
+    // Thread safe only with submit 
+    // Nocall: everything while the pump is running (options.pump)
+    void move_to_processors();
+
+    // Hands a batch made somewhere else (ie by EventJournalReader) to the processors the way move_to_processors 
+    // would, without the journal. Takes over one reference to the batch
+    // Can run while another thread or the pump moves, the batch is ordered by itself and not with the others
+    inline void add_batch(EventBatch* batch)
+    {
+        // Routing reads the ids, events in a batch made elsewhere may not have been through submit
+        for (size_t i = 0; i < batch->size(); i++)
+        {
+            batch->data()[i]->resolve_type_id();
+        }
+
+        std::shared_lock lock(processor_and_sub);
+        std::lock_guard hand_out_lock(hand_out_mutex);
+        hand_out(batch);
+    }
+
+#ifdef EVENT_STATS
+    // Counters are read without stopping anything, so values taken together may be a moment apart
+    EventStats get_stats();
+#endif
+
+#ifdef EVENT_PROFILE_HANDLERS
+    // Profile of every subscription on every processor, sort by max_ns or estimated_total_ns to find slow handlers
+    std::vector<HandlerProfileStats> get_handler_profile();
+#endif
+};
+
+template <typename T> 
+std::pair<size_t, size_t> min_max_val(const std::vector<std::pair<T, size_t>>& input)
+{
+    size_t min_val = SIZE_MAX, max_val = 0;
+    for (auto& v : input)
+    {
+        min_val = v.second < min_val ? v.second : min_val;
+        max_val = max_val < v.second ? v.second : max_val;
+    }
+    return { min_val, max_val };
+}
+
+// Radix with a power of two base N, digits are shifts and masks and the histograms of every pass are built 
+// in one read of the input
+// Each pass counts into sub_histograms interleaved copies, sequence numbers share their high digits so a single 
+// copy would increment the same counter back to back and stall on the store of the previous increment
+// Sorts any value type, key(val) gives the size_t key of a value
+template <size_t N, size_t sub_histograms = 4, typename U, typename Key> 
+void radix_pow2_by(std::vector<U>& input, Key key_of)
+{
+    static_assert(std::has_single_bit(N) && N > 1);
+    constexpr size_t bits = std::countr_zero(N);
+    constexpr size_t mask = N - 1;
+    constexpr size_t max_passes = (64 + bits - 1) / bits;
+
+    size_t size = input.size();
+    size_t max_num = 0;
+    for (const auto& val : input)
+    {
+        max_num = std::max<size_t>(max_num, key_of(val));
+    }
+    if (max_num == 0) return;
+
+    assert(size <= UINT32_MAX);
+    size_t passes = (std::bit_width(max_num) + bits - 1) / bits;
+
+    uint32_t histograms[sub_histograms][max_passes][N] = {};
+
+    size_t i = 0;
+    for (; i + sub_histograms <= size; i += sub_histograms)
+    {
+        for (size_t k = 0; k < sub_histograms; k++)
+        {
+            size_t key = key_of(input[i + k]);
+            for (size_t pass = 0; pass < passes; pass++)
+            {
+                histograms[k][pass][(key >> (pass * bits)) & mask]++;
+            }
+        }
+    }
+    for (; i < size; i++)
+    {
+        size_t key = key_of(input[i]);
+        for (size_t pass = 0; pass < passes; pass++)
+        {
+            histograms[0][pass][(key >> (pass * bits)) & mask]++;
+        }
+    }
+
+    std::vector<U> s_input(size);
+    auto* from = &input;
+    auto* to = &s_input;
+
+    for (size_t pass = 0; pass < passes; pass++)
+    {
+        // Exclusive prefix sums of the merged histogram, a pass where every key has the same digit changes nothing
+        size_t offsets[N];
+        size_t total = 0;
+        bool trivial = false;
+        for (size_t digit = 0; digit < N; digit++)
+        {
+            size_t count = 0;
+            for (size_t k = 0; k < sub_histograms; k++) count += histograms[k][pass][digit];
+
+            trivial |= count == size;
+            offsets[digit] = total;
+            total += count;
+        }
+        if (trivial) continue;
+
+        size_t shift = pass * bits;
+        for (auto& val : *from)
+        {
+            (*to)[offsets[(key_of(val) >> shift) & mask]++] = val;
+        }
+        std::swap(from, to);
+    }
+
+    if (from != &input) input.swap(s_input);
+}
+
+template <typename T, size_t N, size_t sub_histograms = 4> 
+void radix_pow2(std::vector<std::pair<T, size_t>>& input)
+{
+    radix_pow2_by<N, sub_histograms>(input, [](const std::pair<T, size_t>& x) { return x.second; });
+}
+
+// Radix with base N on any value type, key(val) gives the size_t key of a value
+template <size_t N, typename U, typename Key> 
+void radix_by(std::vector<U>& input, Key key_of)
+{
+    if constexpr (std::has_single_bit(N))
+    {
+        radix_pow2_by<N>(input, key_of);
+        return;
+    }
+
+    size_t max_num = 0;
+    for (const auto& val : input)
+    {
+        max_num = std::max<size_t>(max_num, key_of(val));
+    }
+
+    std::vector<U> s_input(input.size());
+    size_t iterations = 0;
+    size_t digits = 0;
+    for (; max_num; max_num /= N) digits++;
+
+    size_t count[N];
+    for (size_t exp = 1; iterations < digits; iterations++, exp *= N)
+    {
+        auto& from = iterations % 2 == 0 ? input : s_input;
+        auto& to = iterations % 2 == 0 ? s_input : input;
+        count_sort_by(from.data(), to.data(), from.size(), count, N, 
+            [&](const U& x) { return (key_of(x) / exp) % N; });
+    }
+
+    if (iterations % 2) input.swap(s_input);
+}
+
+// Radix with base N
+template <typename T, size_t N> 
+void radix(std::vector<std::pair<T, size_t>>& input)
+{
+    radix_by<N>(input, [](const std::pair<T, size_t>& x) { return x.second; });
+}
+
+// Sorts input by key_of on the calling thread below sequential_threshold, otherwise splits it into 1 << base 
+// buckets on the top bits of the key and sorts the buckets on the pool, then calls emit on each value in order
+// Keys must be below range + 1
+template <size_t N, size_t base, typename U, typename Key, typename Emit>
+void bucketed_radix(std::vector<U>& input, size_t range, ThreadPool& pool, size_t sequential_threshold, 
+    Key key_of, Emit emit)
+{
+    if (range == 0 || input.size() < sequential_threshold)
+    {
+        if (range != 0) radix_by<N>(input, key_of);
+
+        for (const auto& val : input)
+        {
+            emit(val);
+        }
+        return;
+    }
+
+    // Each bucket for each thread
+    constexpr size_t num_buckets = size_t(1) << base;
+    std::array<std::vector<U>, num_buckets> buckets;
+    for (auto& bucket : buckets)
+    {
+        bucket.reserve(input.size() / num_buckets + input.size() / (4 * num_buckets));
+    }
+
+    size_t shift = std::max<size_t>(std::bit_width(range), base) - base;
+    for (const auto& val : input)
+    {
+        buckets[key_of(val) >> shift].push_back(val);
+    }
+
+    pool.parallel_for(buckets.size(), [&](size_t i) {
+        radix_by<N>(buckets[i], key_of);
+    });
+
+    for (const auto& bucket : buckets)
+    {
+        for (const auto& val : bucket)
+        {
+            emit(val);
+        }
+    }
+}
+
+// Multithreaded radix, splits the numbers into buckets and then calls radix on each bucket with base N
+// Inputs smaller than sequential_threshold are sorted on the calling thread
+// Writes the sorted values to output, which needs room for input.size() values
+// The keys in input are replaced by their offset from the smallest key
+// With compact_keys and a power of two N, batches whose offsets and size fit in 32 bits sort 8 byte 
+// (offset << 32 | index) keys instead of the 16 byte pairs and gather the values by index afterwards
+template <typename T, size_t N, size_t base = 4>
+void multithreaded_radix(
+    std::vector<std::pair<T, size_t>>& input, T* output, ThreadPool& pool, 
+    size_t sequential_threshold = 0, bool compact_keys = false)
+{
+    if (input.empty()) return;
+
+    // Sequence numbers never reset, so bucketing on the top bits of the raw values would put a whole batch in 
+    // one bucket after a while. Offsets from the smallest one spread evenly and need fewer radix passes too
+    auto [min_num, max_num] = min_max_val(input);
+    size_t range = max_num - min_num;
+    for (auto& val : input)
+    {
+        val.second -= min_num;
+    }
+
+    if constexpr (std::has_single_bit(N))
+    {
+        if (compact_keys && range <= UINT32_MAX && input.size() <= UINT32_MAX)
+        {
+            std::vector<uint64_t> keys(input.size());
+            for (size_t i = 0; i < input.size(); i++)
+            {
+                keys[i] = (uint64_t(input[i].second) << 32) | i;
+            }
+
+            // Index bits are below the offset bits, so the radix passes only ever look at the offset
+            bucketed_radix<N, base>(keys, range, pool, sequential_threshold, 
+                [](uint64_t key) { return size_t(key >> 32); }, 
+                [&](uint64_t key) { *output++ = input[uint32_t(key)].first; });
+            return;
+        }
+    }
+
+    bucketed_radix<N, base>(input, range, pool, sequential_threshold, 
+        [](const std::pair<T, size_t>& x) { return x.second; }, 
+        [&](const std::pair<T, size_t>& x) { *output++ = x.first; });
+}
+
+// Orders input by writing each value to its offset from the smallest sequence number, sequence numbers must be unique
+// Returns false without touching output if the range is more than max_spread times the input size, sorting is cheaper then
+// output needs room for input.size() values
+template <typename T>
+bool sequence_scatter(const std::vector<std::pair<T, size_t>>& input, 
+    T* output, size_t max_spread = 4)
+{
+    if (input.empty()) return true;
+
+    auto [min_num, max_num] = min_max_val(input);
+    size_t range = max_num - min_num + 1;
+
+    if (range / max_spread > input.size()) return false;
+
+    // Dense, every slot gets written
+    if (range == input.size())
+    {
+        for (auto& val : input)
+        {
+            output[val.second - min_num] = val.first;
+        }
+        return true;
+    }
+
+    // Some sequence numbers are still in flight, scatter with holes and then compact
+    std::vector<T> slots(range);
+    std::vector<uint8_t> filled(range, 0);
+    for (auto& val : input)
+    {
+        slots[val.second - min_num] = val.first;
+        filled[val.second - min_num] = 1;
+    }
+
+    size_t out = 0;
+    for (size_t i = 0; i < range; i++)
+    {
+        if (filled[i]) output[out++] = std::move(slots[i]);
+    }
+    return true;
+}
+
+#ifdef EVENT_IMPLEMENTATION
+
+MultiEventManager::~MultiEventManager()
+{
+    if (!pump_thread.joinable()) return;
+
+    {
+        std::lock_guard lock(pump_mutex);
+        pump_stopping = true;
+    }
+    pump_wake.notify_one();
+    pump_thread.join();
+}
+
+void MultiEventManager::pump_loop()
+{
+    bool per_producer = options.ordering == EventOrdering::per_producer;
+    auto pending = [&] { 
+        return per_producer ? event_queue.size_approx() + value_queue.size_approx() 
+            : event_count.load() - subtracted; 
+    };
+
+    std::unique_lock lock(pump_mutex);
+    while (!pump_stopping)
+    {
+        if (per_producer)
+        {
+            pump_wake.wait_for(lock, options.pump_latency, [&] { return pump_stopping; });
+            if (pump_stopping || pending() == 0) continue;
+        }
+        else
+        {
+            // Any submit wakes an idle pump, arming before reading the count means either this thread sees the 
+            // event or its submit sees the armed value
+            pump_notify_at.store(subtracted);
+            pump_wake.wait(lock, [&] { return pump_stopping || pending() > 0; });
+            if (pump_stopping) break;
+
+            // Then wait for a full batch or until the first event is pump_latency old
+            auto deadline = std::chrono::steady_clock::now() + options.pump_latency;
+            pump_notify_at.store(subtracted + std::max<size_t>(options.pump_batch_size, 1) - 1);
+            pump_wake.wait_until(lock, deadline, [&] { 
+                return pump_stopping || pending() >= options.pump_batch_size; 
+            });
+            pump_notify_at.store(SIZE_MAX);
+            if (pump_stopping) break;
+        }
+
+        // Submits that want to wake the pump take pump_mutex, so it is not held while moving
+        lock.unlock();
+        {
+            std::shared_lock processors_lock(processor_and_sub);
+            if (!processors.empty()) move_to_processors();
+        }
+        lock.lock();
+    }
+}
+
+size_t MultiEventManager::get_processor(int numa_node)
+{
+    std::unique_lock lock(processor_and_sub);
+
+    EventArenaPool* pool = &arena_pool;
+    if (numa_node >= 0)
+    {
+        if ((size_t) numa_node >= numa_arena_pools.size())
+        {
+            numa_arena_pools.resize(numa_node + 1);
+            node_replicas.resize(numa_node + 1, nullptr);
+        }
+        if (!numa_arena_pools[numa_node]) numa_arena_pools[numa_node] = std::make_unique<EventArenaPool>(numa_node);
+        pool = numa_arena_pools[numa_node].get();
+
+        for (auto& processor : processors)
+        {
+            int other = processor->get_numa_node();
+            numa_spread |= other >= 0 && other != numa_node;
+        }
+    }
+
+    // A token without a producer means the queue could not allocate one
+    moodycamel::ProducerToken token(event_queue);
+    auto value_producer = std::make_unique<moodycamel::ProducerToken>(value_queue);
+    if (!token.valid() || !value_producer->valid()) throw std::bad_alloc();
+
+    processors.push_back(std::make_unique<EventProcessor>(
+        std::move(token), pool, 
+        options.processor_queue_capacity, options.backpressure, numa_node));
+    value_producers.push_back(std::move(value_producer));
+    return processors.size() - 1;
+}
+
+void MultiEventManager::submit(size_t processor_id, Event* event)
+{
+    event->resolve_type_id();
+#ifdef EVENT_STATS
+    event->submit_ns = stats_now_ns();
+#endif
+
+    // Every producer would contend on event_count
+    size_t sequence = options.ordering == EventOrdering::per_producer 
+        ? 0 : event_count.fetch_add(1);
+
+    event_queue.enqueue(processors[processor_id]->get_producer(), 
+        std::make_pair(event, sequence));
+
+    if (options.pump) notify_pump(sequence + 1);
+}
+
+void MultiEventManager::submit_bulk(size_t processor_id, Event** events, size_t n)
+{
+    if (n == 0) return;
+
+#ifdef EVENT_STATS
+    uint64_t submit_ns = stats_now_ns();
+#endif
+    for (size_t i = 0; i < n; i++)
+    {
+        events[i]->resolve_type_id();
+#ifdef EVENT_STATS
+        events[i]->submit_ns = submit_ns;
+#endif
+    }
+
+    size_t sequence = options.ordering == EventOrdering::per_producer 
+        ? 0 : event_count.fetch_add(n);
+
+    // Stamps the events while the queue copies them, so no buffer of pairs is needed
+    struct stamp_iterator
+    {
+        Event** event;
+        size_t sequence;
+        size_t step;
+
+        std::pair<Event*, size_t> operator*() const { return { *event, sequence }; }
+        stamp_iterator& operator++() { event++; sequence += step; return *this; }
+        stamp_iterator operator++(int) { auto old = *this; ++*this; return old; }
+    };
+
+    size_t step = options.ordering == EventOrdering::per_producer ? 0 : 1;
+    // get_processor throws instead of handing out an invalid token
+    moodycamel::ProducerToken& producer = processors[processor_id]->get_producer();
+    assert(producer.valid());
+    // GCC keeps a path with a null producer inside enqueue_bulk and warns that it writes out of bounds on it
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstringop-overflow"
+#endif
+    event_queue.enqueue_bulk(producer, stamp_iterator{ events, sequence, step }, n);
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+    if (options.pump) notify_pump(sequence + n);
+}
+
+void MultiEventManager::process_events(size_t processor_id)
+{
+    processors[processor_id]->process_events();
+}
+
+bool MultiEventManager::wait_and_process(size_t processor_id, std::chrono::nanoseconds timeout)
+{
+    EventProcessor& processor = *processors[processor_id];
+    if (!processor.wait_for_events(timeout)) return false;
+
+    processor.process_events();
+    return true;
+}
+
+void MultiEventManager::process_all(ThreadPool& pool)
+{
+    std::shared_lock lock(processor_and_sub);
+    pool.parallel_for(processors.size(), [&](size_t i) {
+        processors[i]->process_events();
+    });
+}
+
+void MultiEventManager::move_to_processors()
+{
+#ifdef EVENT_STATS
+    Timer<std::chrono::steady_clock> stats_timer;
+#endif
+
+    bool per_producer = options.ordering == EventOrdering::per_producer;
+    size_t snapshot = event_count.load();
+    size_t to_get = per_producer ? event_queue.size_approx() : snapshot - subtracted;
+
+    auto& stored = dequeued;
+    stored.resize(to_get);
+    size_t event_got = event_queue.try_dequeue_bulk(stored.data(), to_get); 
 
     stored.resize(event_got);
 
-    auto copy_to = multithreaded_radix<Event*, 32>(stored);
-    auto event_shared = create_delete_shared(copy_to);
+    // Pipelines that never submit value events keep the Event* only path
+    size_t values_got = 0;
+    dequeued_values.clear();
+    if (value_queue.size_approx() != 0 || !carried_values.empty())
+    {
+        size_t values_to_get = per_producer ? value_queue.size_approx() : to_get;
+        dequeued_values.resize(values_to_get);
+        values_got = value_queue.try_dequeue_bulk(dequeued_values.data(), values_to_get);
+        dequeued_values.resize(values_got);
+    }
+
+    // Both queues are cut at the same sequence number, the rest of either one goes with the next move
+    if (!per_producer)
+    {
+        carry_after(stored, carried, snapshot, [](const std::pair<Event*, size_t>& event) { return event.second; });
+        carry_after(dequeued_values, carried_values, snapshot, [](const ValueCell& cell) { return cell.sequence; });
+        event_got = stored.size();
+        values_got = dequeued_values.size();
+    }
+
+    // Ordered straight into the batch, hand_out gives every processor it reaches a reference
+    EventBatch* batch = values_got ? nullptr : EventBatch::create(event_got);
 
-    for (auto& processor : processors)
+#ifdef EVENT_STATS
+    uint64_t copy_time = stats_timer.get_time_ns().count();
+    stats_timer.reset_timer();
+#endif
+
+    if (values_got)
+    {
+        batch = order_with_values(values_got);
+    }
+    else if (options.ordering == EventOrdering::per_producer)
+    {
+        // The queue hands out each producer's events in the order they were enqueued
+        for (size_t i = 0; i < event_got; i++)
+        {
+            batch->data()[i] = stored[i].first;
+        }
+    }
+    else if (options.ordering == EventOrdering::radix || 
+        !sequence_scatter(stored, batch->data()))
+    {
+        multithreaded_radix<Event*, 32>(stored, batch->data(), worker_pool, 
+            options.sequential_sort_threshold, options.compact_sort_keys);
+    }
+
+#ifdef EVENT_STATS
+    stat_sort_ns.add(stats_timer.get_time_ns().count());
+    stats_timer.reset_timer();
+#endif
+
+    if (any_conflations) conflate_batch(batch);
+    if (options.journal) options.journal->write(*batch);
     {
-        processor.add_events(event_shared, event_got);
+        std::lock_guard lock(hand_out_mutex);
+        hand_out(batch);
     }
     
-    subtracted += event_got;
+    subtracted += event_got + values_got;
+
+#ifdef EVENT_STATS
+    stat_copy_ns.add(copy_time + stats_timer.get_time_ns().count());
+    stat_events_moved.add(event_got + values_got);
+    stat_batches_moved.add(1);
+    stat_batch_sizes.record(event_got + values_got);
+#endif
+}
+
+void MultiEventManager::conflate_batch(EventBatch* batch)
+{
+    auto is_conflated = [&](size_t id) { return conflated_ids[id / 64] >> (id % 64) & 1; };
+    auto& keep = conflate_keep;
+    auto& dropped = conflate_dropped;
+    auto& touched = conflate_touched;
+    dropped.clear();
+    touched.clear();
+
+    // From the back, the first time a key shows up is the event that stays
+    size_t num_dropped = 0;
+    auto check = [&](size_t id, void* event) {
+        Conflation* conflation = conflations[id].get();
+        if (!conflation->touched)
+        {
+            conflation->touched = true;
+            touched.push_back(id);
+        }
+        if (!conflation->seen_before(event)) return true;
+        num_dropped++;
+        return false;
+    };
+
+    Event** events = batch->data();
+    if (!batch->has_values())
+    {
+        size_t n = batch->size();
+        keep.assign(n, 1);
+        for (size_t i = n; i-- > 0; )
+        {
+            size_t id = events[i]->get_type_id();
+            if (is_conflated(id) && !check(id, events[i])) 
+            {
+                keep[i] = 0;
+                dropped.push_back(events[i]);
+            }
+        }
+
+        if (!dropped.empty())
+        {
+            size_t kept = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                if (keep[i]) events[kept++] = events[i];
+            }
+            batch->shrink_events(kept);
+        }
+    }
+    else
+    {
+        auto& records = conflate_records;
+        records.clear();
+        for (ValueRecord* record = batch->records(), *end = batch->records_end(); record != end; record = record->next())
+        {
+            records.push_back(record);
+        }
+
+        keep.assign(records.size(), 1);
+        for (size_t i = records.size(); i-- > 0; )
+        {
+            ValueRecord* record = records[i];
+            void* event = record->data();
+            size_t id = record->id;
+            if (id == ValueRecord::pointer_record)
+            {
+                event = *static_cast<Event**>(event);
+                id = static_cast<Event*>(event)->get_type_id();
+            }
+            if (is_conflated(id) && !check(id, event)) keep[i] = 0;
+        }
+
+        // Records only move towards the front, the Event* entries of dropped pointer records are nulled
+        unsigned char* out = reinterpret_cast<unsigned char*>(batch->records());
+        size_t values = 0, pointers = 0;
+        for (size_t i = 0; i < records.size() && num_dropped; i++)
+        {
+            ValueRecord* record = records[i];
+            bool pointer = record->id == ValueRecord::pointer_record;
+            size_t bytes = sizeof(ValueRecord) + record->size;
+            if (keep[i])
+            {
+                memmove(out, record, bytes);
+                out += bytes;
+                values += !pointer;
+            }
+            else if (pointer)
+            {
+                dropped.push_back(events[pointers]);
+                events[pointers] = nullptr;
+            }
+            pointers += pointer;
+        }
+        if (num_dropped) batch->shrink_records(values, out - reinterpret_cast<unsigned char*>(batch->records()));
+    }
+
+    for (size_t id : touched)
+    {
+        conflations[id]->reset();
+        conflations[id]->touched = false;
+    }
+
+#ifdef EVENT_STATS
+    stat_events_conflated.add(num_dropped);
+#endif
+
+    // Early, their arena blocks can be recycled before the rest of the batch is done
+    release_events(dropped.data(), dropped.size());
+}
+
+void MultiEventManager::hand_out(EventBatch* batch)
+{
+    // Handlers read value events out of the records, Event* events stay in the arena they were made in
+    replicate = numa_spread && batch->has_values() && batch->bytes() >= options.numa_replica_min_bytes;
+    if (replicate) move_node = current_numa_node();
+
+    route_batch(batch);
+
+    for (auto& replica : node_replicas)
+    {
+        if (replica) replica->release();
+        replica = nullptr;
+    }
+}
+
+void MultiEventManager::route_batch(EventBatch* batch)
+{
+    auto broadcast = [&] {
+        batch->acquire(processors.size());
+        for (size_t p = 0; p < processors.size(); p++)
+        {
+            processors[p]->add_events(local_batch(batch, p));
+        }
+        batch->release();
+    };
+
+    bool any_partitions = std::any_of(partitioned_ids.begin(), partitioned_ids.end(), 
+        [](uint64_t word) { return word != 0; });
+    if ((!options.route_by_subscription && !any_partitions) || processors.size() < 2) return broadcast();
+
+    // Ids in the batch, one pass over the event headers (or records) instead of one per processor
+    size_t words = EventProcessor::subscription_mask_words();
+    present_ids.assign(words, 0);
+    batch_ids.resize(batch->size());
+    if (batch->has_values())
+    {
+        for (ValueRecord* record = batch->records(), *end = batch->records_end(); record != end; record = record->next())
+        {
+            size_t id = record->id == ValueRecord::pointer_record 
+                ? (*static_cast<Event**>(record->data()))->get_type_id() : record->id;
+            present_ids[id / 64] |= uint64_t(1) << (id % 64);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < batch->size(); i++)
+        {
+            size_t id = batch_ids[i] = uint32_t(batch->data()[i]->get_type_id());
+            present_ids[id / 64] |= uint64_t(1) << (id % 64);
+        }
+    }
+
+    for (size_t w = 0; w < words; w++)
+    {
+        if (present_ids[w] & partitioned_ids[w]) return hand_out_partitioned(batch);
+    }
+    if (!options.route_by_subscription) return broadcast();
+
+    // Every processor gets nothing, the whole batch or the subset of its group
+    // Processors that handle the same of the present ids are a group and share one subset
+    constexpr size_t route_none = SIZE_MAX, route_all = SIZE_MAX - 1;
+    routes.assign(processors.size(), route_none);
+    route_mask.resize(words);
+    group_masks.clear();
+    size_t groups = 0, delivered = 0, total_routed = 0;
+
+    for (size_t p = 0; p < processors.size(); p++)
+    {
+        bool any = false, all = true;
+        for (size_t w = 0; w < words; w++)
+        {
+            route_mask[w] = processors[p]->subscription_mask(w) & present_ids[w];
+            any |= route_mask[w] != 0;
+            all &= route_mask[w] == present_ids[w];
+        }
+
+        if (!any) continue;
+        delivered++;
+        if (all || batch->has_values())
+        {
+            routes[p] = route_all;
+            continue;
+        }
+
+        size_t group = 0;
+        while (group < groups && !std::equal(route_mask.begin(), route_mask.end(), group_masks.begin() + group * words)) group++;
+        routes[p] = group;
+        if (group < groups) continue;
+
+        // Filtered against the mask read above, so a subscribe in between cannot make the count wrong
+        group_masks.insert(group_masks.end(), route_mask.begin(), route_mask.end());
+        if (routed.size() == groups) routed.emplace_back();
+        auto& events = routed[groups++];
+        events.clear();
+        for (size_t i = 0; i < batch->size(); i++)
+        {
+            size_t id = batch_ids[i];
+            if (route_mask[id / 64] >> (id % 64) & 1) events.push_back(batch->data()[i]);
+        }
+        total_routed += events.size();
+    }
+
+    Event** subsets = total_routed ? batch->allocate_subsets(total_routed) : nullptr;
+    group_starts.resize(groups);
+    for (size_t group = 0; group < groups; group++)
+    {
+        group_starts[group] = subsets;
+        subsets = std::copy(routed[group].begin(), routed[group].end(), subsets);
+    }
+
+    batch->acquire(delivered);
+    for (size_t p = 0; p < processors.size(); p++)
+    {
+        if (routes[p] == route_all)
+        {
+            processors[p]->add_events(local_batch(batch, p));
+        }
+        else if (routes[p] != route_none)
+        {
+            processors[p]->add_events(batch, group_starts[routes[p]], routed[routes[p]].size());
+        }
+    }
+    batch->release();
+}
+
+void MultiEventManager::hand_out_partitioned(EventBatch* batch)
+{
+    size_t words = EventProcessor::subscription_mask_words();
+    size_t count = processors.size();
+
+    // Ids a processor gets that are not partitioned
+    processor_takes.resize(count * words);
+    for (size_t p = 0; p < count; p++)
+    {
+        for (size_t w = 0; w < words; w++)
+        {
+            uint64_t mask = options.route_by_subscription ? processors[p]->subscription_mask(w) : ~uint64_t(0);
+            processor_takes[p * words + w] = mask & present_ids[w] & ~partitioned_ids[w];
+        }
+    }
+    auto takes = [&](size_t p, size_t id) { return processor_takes[p * words + id / 64] >> (id % 64) & 1; };
+    auto is_partitioned = [&](size_t id) { return partitioned_ids[id / 64] >> (id % 64) & 1; };
+
+    // Value batches go whole to every processor that gets any of it, the owners tell them which records to skip
+    if (batch->has_values())
+    {
+        routes.assign(count, 0);
+        const EventProcessor** owners = batch->allocate_owners();
+        for (ValueRecord* record = batch->records(), *end = batch->records_end(); record != end; record = record->next())
+        {
+            void* event = record->data();
+            size_t id = record->id;
+            if (id == ValueRecord::pointer_record)
+            {
+                event = *static_cast<Event**>(event);
+                id = static_cast<Event*>(event)->get_type_id();
+            }
+
+            const EventProcessor* owner = nullptr;
+            if (is_partitioned(id))
+            {
+                size_t p = partitions[id]->owner(event);
+                owner = processors[p].get();
+                routes[p] = 1;
+            }
+            *owners++ = owner;
+        }
+
+        for (size_t p = 0; p < count; p++)
+        {
+            for (size_t w = 0; w < words && !routes[p]; w++)
+            {
+                if (processor_takes[p * words + w]) routes[p] = 1;
+            }
+        }
+
+        batch->acquire(std::count(routes.begin(), routes.end(), 1));
+        for (size_t p = 0; p < count; p++)
+        {
+            if (routes[p]) processors[p]->add_events(local_batch(batch, p));
+        }
+        batch->release();
+        return;
+    }
+
+    // One pass that appends each event to its owner or to every processor that takes it
+    if (routed.size() < count) routed.resize(count);
+    for (size_t p = 0; p < count; p++)
+    {
+        routed[p].clear();
+    }
+    for (size_t i = 0; i < batch->size(); i++)
+    {
+        Event* event = batch->data()[i];
+        size_t id = batch_ids[i];
+        if (is_partitioned(id))
+        {
+            routed[partitions[id]->owner(event)].push_back(event);
+            continue;
+        }
+        for (size_t p = 0; p < count; p++)
+        {
+            if (takes(p, id)) routed[p].push_back(event);
+        }
+    }
+
+    // A list as long as the batch is the batch
+    size_t total_routed = 0, delivered = 0;
+    for (size_t p = 0; p < count; p++)
+    {
+        if (routed[p].size() != batch->size()) total_routed += routed[p].size();
+        delivered += !routed[p].empty();
+    }
+
+    Event** subsets = total_routed ? batch->allocate_subsets(total_routed) : nullptr;
+    batch->acquire(delivered);
+    for (size_t p = 0; p < count; p++)
+    {
+        if (routed[p].size() == batch->size())
+        {
+            processors[p]->add_events(local_batch(batch, p));
+        }
+        else if (!routed[p].empty())
+        {
+            Event** events = subsets;
+            subsets = std::copy(routed[p].begin(), routed[p].end(), subsets);
+            processors[p]->add_events(batch, events, routed[p].size());
+        }
+    }
+    batch->release();
+}
+
+EventBatch* MultiEventManager::order_with_values(size_t values_got)
+{
+    auto& stored = dequeued;
+    size_t event_got = stored.size();
+    size_t total = event_got + values_got;
+
+    size_t record_bytes = event_got * (sizeof(ValueRecord) + sizeof(Event*));
+
+    auto& mixed = dequeued_mixed;
+    mixed.clear();
+    for (auto& [event, sequence] : stored)
+    {
+        mixed.emplace_back(reinterpret_cast<uintptr_t>(event), sequence);
+    }
+    for (auto& cell : dequeued_values)
+    {
+        mixed.emplace_back(reinterpret_cast<uintptr_t>(&cell) | 1, cell.sequence);
+        record_bytes += sizeof(ValueRecord) + ((cell.size + 7) & ~size_t(7));
+    }
+
+    auto& ordered = ordered_mixed;
+    ordered.resize(total);
+    if (options.ordering == EventOrdering::per_producer)
+    {
+        // No order between the two queues, Event* submits go first
+        for (size_t i = 0; i < total; i++)
+        {
+            ordered[i] = mixed[i].first;
+        }
+    }
+    else if (options.ordering == EventOrdering::radix || 
+        !sequence_scatter(mixed, ordered.data()))
+    {
+        multithreaded_radix<uintptr_t, 32>(mixed, ordered.data(), worker_pool, 
+            options.sequential_sort_threshold, options.compact_sort_keys);
+    }
+
+    EventBatch* batch = EventBatch::create(event_got, 1, values_got, record_bytes);
+    Event** events = batch->data();
+    ValueRecord* record = batch->records();
+    for (uintptr_t address : ordered)
+    {
+        if (address & 1)
+        {
+            auto* cell = reinterpret_cast<const ValueCell*>(address & ~uintptr_t(1));
+            record->id = cell->id;
+            record->size = (cell->size + 7) & ~uint32_t(7);
+            // A fixed size copy instead of a memcpy call, the batch has room past the last record for it
+            memcpy(record->data(), cell->data, max_value_event_size);
+        }
+        else
+        {
+            Event* event = reinterpret_cast<Event*>(address);
+            *events++ = event;
+            record->id = ValueRecord::pointer_record;
+            record->size = sizeof(Event*);
+            memcpy(record->data(), &event, sizeof(Event*));
+        }
+        record = record->next();
+    }
+    return batch;
+}
+
+#ifdef EVENT_PROFILE_HANDLERS
+std::vector<HandlerProfileStats> MultiEventManager::get_handler_profile()
+{
+    std::vector<HandlerProfileStats> rval;
+    std::shared_lock lock(processor_and_sub);
+    for (size_t i = 0; i < processors.size(); i++)
+    {
+        size_t first = rval.size();
+        processors[i]->get_handler_profile(rval);
+        for (size_t j = first; j < rval.size(); j++)
+        {
+            rval[j].processor_id = i;
+        }
+    }
+    return rval;
 }
+#endif
+
+#ifdef EVENT_STATS
+EventStats MultiEventManager::get_stats()
+{
+    EventStats rval;
+    rval.events_moved = stat_events_moved.get();
+    rval.events_conflated = stat_events_conflated.get();
+    rval.batches_moved = stat_batches_moved.get();
+    rval.batch_sizes = stat_batch_sizes.snapshot();
+    rval.copy_ns = stat_copy_ns.get();
+    rval.sort_ns = stat_sort_ns.get();
+
+    std::shared_lock lock(processor_and_sub);
+    for (auto& processor : processors)
+    {
+        rval.processors.push_back(processor->get_stats());
+    }
+    return rval;
+}
+#endif
 
 #endif
 
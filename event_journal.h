@@ -0,0 +1,379 @@
+#pragma once
+
+// Journal of the batches move_to_processors makes, kept in memory mapped segment files that can be replayed
+// POSIX only, include after defining EVENT_IMPLEMENTATION in the same translation unit as event.h
+
+#include "event.h"
+
+// std
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+// platform
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A segment is a JournalSegmentHeader padded to header_bytes, then frames of a JournalFrame followed by its
+// records in the ValueRecord layout of EventBatch. A frame with 0 bytes or the end of the file ends the segment
+struct JournalSegmentHeader
+{
+    static constexpr uint64_t magic_value = 0x4c4e524a544e5645; // EVNTJRNL
+    static constexpr uint32_t current_version = 1;
+    static constexpr uint32_t header_bytes = 64;
+
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_bytes_used;
+    uint64_t segment;
+};
+
+struct JournalFrame
+{
+    // Bytes of records after the frame
+    uint32_t bytes;
+    uint32_t count;
+    // Index of the batch among every batch the journal was given, batches without value events are not written
+    uint64_t batch;
+};
+
+struct EventJournalOptions
+{
+    // Size segments are created with, a batch larger than this gets a segment of its own
+    size_t segment_bytes = size_t(64) << 20;
+
+    // msync after every batch instead of leaving the write back to the kernel
+    bool sync_every_batch = false;
+};
+
+// Segments in directory in the order they were written
+std::vector<std::filesystem::path> list_journal_segments(const std::filesystem::path& directory);
+
+// Appends the value events of every batch it is given, ie as EventManagerOptions::journal
+// Event* events are left out since they are not trivially copyable, submit them with submit_value to journal them
+// ids come from EVENT_GEN, so a journal can only be replayed by a build with the same event ids
+// Segments are named 00000000.journal, 00000001.journal ... and a new journal continues after the segments
+// already in directory
+// write runs inside move_to_processors and does not throw: once a segment can not be created or synced the 
+// journal stops writing, so it never has a hole, and error() says why
+class EventJournal : public BatchSink
+{
+private:
+    std::filesystem::path directory;
+    EventJournalOptions options;
+    std::error_code failure;
+
+    uint64_t next_segment = 0;
+    uint64_t batches = 0;
+
+    // Segment being written, created on the first batch that has to go into it
+    int fd = -1;
+    unsigned char* mapping = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+
+    void open_segment(size_t frame_bytes);
+    void close_segment();
+public:
+    explicit EventJournal(std::filesystem::path directory, const EventJournalOptions& options = {});
+    ~EventJournal();
+
+    EventJournal(const EventJournal& other) = delete;
+    EventJournal& operator=(const EventJournal& other) = delete;
+
+    void write(EventBatch& batch) noexcept override;
+
+    // Writes the mapped segment back to its file, throws std::system_error when that fails
+    void flush();
+
+    // Set once a write failed, the batches after it were not written
+    inline std::error_code error() const { return failure; }
+};
+
+// Reads the batches of a journal back, the batches read their records straight out of the mapped segments
+// and keep their segment mapped until they are released, so nothing is allocated per event
+// Every record has to be a value event of this build with its size (see value_event_size) before a handler sees it
+// Throws std::system_error when a segment can not be mapped and std::runtime_error on a corrupt segment
+class EventJournalReader
+{
+private:
+    struct Segment
+    {
+        void* memory = nullptr;
+        size_t bytes = 0;
+        ~Segment();
+    };
+
+    std::vector<std::filesystem::path> segments;
+    size_t next_segment = 0;
+    std::shared_ptr<Segment> current;
+    size_t offset = 0;
+
+    void open_segment(const std::filesystem::path& path);
+public:
+    explicit EventJournalReader(const std::filesystem::path& directory);
+
+    // Next batch holding one reference, nullptr once every segment has been read
+    EventBatch* next();
+
+    // Hands every remaining batch to the processors of manager, returns how many batches that was
+    // Processors have to be drained while this runs unless their queues grow (Backpressure::grow)
+    size_t replay(MultiEventManager& manager);
+};
+
+#ifdef EVENT_IMPLEMENTATION
+
+[[noreturn]] inline void throw_journal_error(const std::string& what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+std::vector<std::filesystem::path> list_journal_segments(const std::filesystem::path& directory)
+{
+    std::vector<std::pair<uint64_t, std::filesystem::path>> found;
+    std::error_code error;
+    for (auto& entry : std::filesystem::directory_iterator(directory, error))
+    {
+        auto& path = entry.path();
+        std::string stem = path.stem().string();
+        if (path.extension() != ".journal" || stem.empty() ||
+            stem.find_first_not_of("0123456789") != std::string::npos) continue;
+        found.emplace_back(std::stoull(stem), path);
+    }
+
+    std::sort(found.begin(), found.end());
+    std::vector<std::filesystem::path> segments;
+    for (auto& [index, path] : found)
+    {
+        segments.push_back(path);
+    }
+    return segments;
+}
+
+EventJournal::EventJournal(std::filesystem::path directory, const EventJournalOptions& options)
+    : directory(std::move(directory)), options(options)
+{
+    std::filesystem::create_directories(this->directory);
+
+    auto segments = list_journal_segments(this->directory);
+    if (!segments.empty()) next_segment = std::stoull(segments.back().stem().string()) + 1;
+}
+
+EventJournal::~EventJournal()
+{
+    close_segment();
+}
+
+void EventJournal::open_segment(size_t frame_bytes)
+{
+    capacity = std::max(options.segment_bytes, JournalSegmentHeader::header_bytes + frame_bytes);
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%08llu.journal", (unsigned long long) next_segment);
+    std::filesystem::path path = directory / name;
+
+    int file = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (file < 0) throw_journal_error("open " + path.string());
+
+    // Nothing is set until the segment is mapped, the empty file is removed so the number can be tried again
+    void* memory = ftruncate(file, (off_t) capacity) == 0 ? 
+        mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0) : MAP_FAILED;
+    if (memory == MAP_FAILED)
+    {
+        int error = errno;
+        ::close(file);
+        std::filesystem::remove(path);
+        errno = error;
+        throw_journal_error("map " + path.string());
+    }
+    fd = file;
+    mapping = static_cast<unsigned char*>(memory);
+
+    JournalSegmentHeader header { JournalSegmentHeader::magic_value, JournalSegmentHeader::current_version,
+        JournalSegmentHeader::header_bytes, next_segment++ };
+    memcpy(mapping, &header, sizeof(header));
+    used = JournalSegmentHeader::header_bytes;
+}
+
+void EventJournal::close_segment()
+{
+    if (!mapping) return;
+
+    munmap(mapping, capacity);
+    // Segments are only as long as their frames, the unused end would read as a zero frame anyway
+    ftruncate(fd, (off_t) used);
+    ::close(fd);
+
+    mapping = nullptr;
+    fd = -1;
+}
+
+void EventJournal::write(EventBatch& batch) noexcept
+{
+    uint64_t index = batches++;
+    if (failure || !batch.has_values()) return;
+
+    // Without Event* records the record block is written as it is
+    size_t bytes = 0, count = 0;
+    if (batch.size() == 0)
+    {
+        bytes = reinterpret_cast<unsigned char*>(batch.records_end()) - reinterpret_cast<unsigned char*>(batch.records());
+        count = batch.value_count();
+    }
+    else
+    {
+        for (ValueRecord* record = batch.records(), *end = batch.records_end(); record != end; record = record->next())
+        {
+            if (record->id == ValueRecord::pointer_record) continue;
+            bytes += sizeof(ValueRecord) + record->size;
+            count++;
+        }
+    }
+    if (count == 0) return;
+
+    size_t frame_bytes = sizeof(JournalFrame) + bytes;
+    if (!mapping || used + frame_bytes > capacity)
+    {
+        close_segment();
+        try
+        {
+            open_segment(frame_bytes);
+        }
+        catch (const std::system_error& error)
+        {
+            failure = error.code();
+            return;
+        }
+    }
+
+    unsigned char* out = mapping + used + sizeof(JournalFrame);
+    if (batch.size() == 0)
+    {
+        memcpy(out, batch.records(), bytes);
+    }
+    else
+    {
+        for (ValueRecord* record = batch.records(), *end = batch.records_end(); record != end; record = record->next())
+        {
+            if (record->id == ValueRecord::pointer_record) continue;
+            size_t record_bytes = sizeof(ValueRecord) + record->size;
+            memcpy(out, record, record_bytes);
+            out += record_bytes;
+        }
+    }
+
+    // Plain stores into the mapping, nothing orders them for another process or across a crash, so a segment 
+    // is only complete once it was flushed or closed. The reader checks every record of a frame it does see
+    JournalFrame frame { (uint32_t) bytes, (uint32_t) count, index };
+    memcpy(mapping + used, &frame, sizeof(frame));
+    used += frame_bytes;
+
+    if (options.sync_every_batch && msync(mapping, used, MS_SYNC) != 0) failure = std::error_code(errno, std::generic_category());
+}
+
+void EventJournal::flush()
+{
+    if (mapping && msync(mapping, used, MS_SYNC) != 0) throw_journal_error("msync");
+}
+
+EventJournalReader::Segment::~Segment()
+{
+    if (memory) munmap(memory, bytes);
+}
+
+EventJournalReader::EventJournalReader(const std::filesystem::path& directory)
+    : segments(list_journal_segments(directory)) {}
+
+void EventJournalReader::open_segment(const std::filesystem::path& path)
+{
+    auto segment = std::make_shared<Segment>();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw_journal_error("open " + path.string());
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        throw_journal_error("fstat " + path.string());
+    }
+    segment->bytes = (size_t) info.st_size;
+
+    // Private so handlers can still write to the events they get, nothing reaches the file
+    void* memory = segment->bytes ? mmap(nullptr, segment->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : nullptr;
+    ::close(fd);
+    if (memory == MAP_FAILED) throw_journal_error("mmap " + path.string());
+    segment->memory = memory;
+
+    JournalSegmentHeader header;
+    if (segment->bytes < JournalSegmentHeader::header_bytes) throw std::runtime_error("truncated journal segment " + path.string());
+    memcpy(&header, memory, sizeof(header));
+    if (header.magic != JournalSegmentHeader::magic_value || header.version != JournalSegmentHeader::current_version)
+    {
+        throw std::runtime_error("not a journal segment " + path.string());
+    }
+
+    current = std::move(segment);
+    offset = header.header_bytes_used;
+}
+
+EventBatch* EventJournalReader::next()
+{
+    for (;;)
+    {
+        JournalFrame frame { 0, 0, 0 };
+        if (current && offset + sizeof(JournalFrame) <= current->bytes)
+        {
+            memcpy(&frame, static_cast<unsigned char*>(current->memory) + offset, sizeof(frame));
+        }
+
+        if (frame.bytes == 0)
+        {
+            current.reset();
+            if (next_segment == segments.size()) return nullptr;
+            open_segment(segments[next_segment++]);
+            continue;
+        }
+
+        unsigned char* begin = static_cast<unsigned char*>(current->memory) + offset + sizeof(JournalFrame);
+        unsigned char* end = begin + frame.bytes;
+        if (offset + sizeof(JournalFrame) + frame.bytes > current->bytes) throw std::runtime_error("truncated journal frame");
+
+        // Ids index the handler tables and handlers read sizeof their event, so a damaged record must not reach 
+        // a processor. The batch has no slack past the last record, the size check keeps handlers inside it
+        size_t count = 0;
+        for (unsigned char* at = begin; at != end; count++)
+        {
+            auto* record = reinterpret_cast<ValueRecord*>(at);
+            if ((size_t) (end - at) < sizeof(ValueRecord)) throw std::runtime_error("corrupt journal record");
+
+            size_t value_size = record->id < max_event_types ? value_event_size(record->id) : 0;
+            if (value_size == 0 || record->size != ((value_size + 7) & ~size_t(7)) ||
+                record->size > (size_t) (end - at) - sizeof(ValueRecord))
+            {
+                throw std::runtime_error("corrupt journal record");
+            }
+            at = reinterpret_cast<unsigned char*>(record->next());
+        }
+        if (count != frame.count) throw std::runtime_error("corrupt journal frame");
+
+        offset += sizeof(JournalFrame) + frame.bytes;
+        return EventBatch::create_external(reinterpret_cast<ValueRecord*>(begin), frame.count, frame.bytes, current);
+    }
+}
+
+size_t EventJournalReader::replay(MultiEventManager& manager)
+{
+    size_t count = 0;
+    while (EventBatch* batch = next())
+    {
+        manager.add_batch(batch);
+        count++;
+    }
+    return count;
+}
+
+#endif
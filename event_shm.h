@@ -0,0 +1,301 @@
+#pragma once
+
+// Value events from other processes on the same host, through a bounded MPMC ring (Vyukov) in a POSIX shm segment
+// POSIX only, include after defining EVENT_IMPLEMENTATION in the same translation unit as event.h
+
+#include "event.h"
+
+// std
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+// platform
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "The ring needs address free atomics to share them between processes");
+
+// One value event in the ring, sequence says whose turn the slot is: pos when it is free for the producer of
+// ticket pos, pos + 1 once that event is in it
+struct ShmSlot
+{
+    std::atomic<uint64_t> sequence;
+    uint32_t id;
+    uint32_t size;
+    alignas(8) unsigned char data[max_value_event_size];
+};
+
+struct ShmRingHeader
+{
+    static constexpr uint64_t magic_value = 0x474e495254564545; // EEVTRING
+    static constexpr uint32_t current_version = 1;
+
+    // Stored last by the creator, nothing else in the segment can be trusted before it reads magic_value
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t slot_bytes;
+    uint64_t capacity;
+
+    // Tickets, taking one is the only point producers contend on, like event_count in process
+    alignas(64) std::atomic<uint64_t> enqueue_pos;
+    // Only written by the consumer
+    alignas(64) std::atomic<uint64_t> dequeue_pos;
+
+    inline ShmSlot* slots() { return reinterpret_cast<ShmSlot*>(this + 1); }
+    static inline size_t bytes(size_t capacity) { return sizeof(ShmRingHeader) + capacity * sizeof(ShmSlot); }
+};
+
+// Maps the segment name (ie /market-ticks), creating it with capacity slots when create is set
+// Opening waits up to timeout for a creator that is still setting the ring up
+// Throws std::system_error when the segment can not be opened and std::runtime_error when it is not a ring
+ShmRingHeader* map_shm_ring(const std::string& name, size_t capacity, bool create, 
+    std::chrono::milliseconds timeout = std::chrono::milliseconds(1000));
+
+// Submits value events into a ring a consumer process created, any number of threads and processes can submit
+// Events from every producer come out in the order their submits took a ticket
+class ShmEventProducer
+{
+private:
+    ShmRingHeader* ring;
+    uint64_t mask;
+public:
+    explicit ShmEventProducer(const std::string& name);
+    ~ShmEventProducer();
+
+    ShmEventProducer(const ShmEventProducer& other) = delete;
+    ShmEventProducer& operator=(const ShmEventProducer& other) = delete;
+
+    // Returns false when the ring is full
+    template <ValueEvent E>
+    inline bool try_submit(const E& event)
+    {
+        uint64_t pos = ring->enqueue_pos.load(std::memory_order_relaxed);
+        ShmSlot* slot;
+        for (;;)
+        {
+            slot = &ring->slots()[pos & mask];
+            int64_t diff = (int64_t) (slot->sequence.load(std::memory_order_acquire) - pos);
+            if (diff == 0)
+            {
+                if (ring->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            }
+            else if (diff < 0) return false;
+            else pos = ring->enqueue_pos.load(std::memory_order_relaxed);
+        }
+
+        slot->id = (uint32_t) E::id;
+        slot->size = (uint32_t) sizeof(E);
+        memcpy(slot->data, &event, sizeof(E));
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Yields until the consumer makes room
+    template <ValueEvent E>
+    inline void submit(const E& event)
+    {
+        while (!try_submit(event)) std::this_thread::yield();
+    }
+};
+
+// Creates the ring and turns what the producers submitted into batches, only one thread may take from a ring
+// A producer that dies between taking a ticket and publishing its event stops the ring at that ticket
+// ids come from EVENT_GEN, so producers have to be the same build. Slots that are not a value event of this 
+// build with its size (see value_event_size) are dropped and counted
+class ShmEventConsumer
+{
+private:
+    std::string name;
+    ShmRingHeader* ring;
+    uint64_t mask;
+    size_t dropped = 0;
+public:
+    // capacity is rounded up to a power of two, the segment is removed again by the destructor
+    ShmEventConsumer(const std::string& name, size_t capacity = 1 << 16);
+    ~ShmEventConsumer();
+
+    ShmEventConsumer(const ShmEventConsumer& other) = delete;
+    ShmEventConsumer& operator=(const ShmEventConsumer& other) = delete;
+
+    // Batch of up to max_events published events in ticket order holding one reference, nullptr if none are 
+    // waiting or every waiting one was dropped
+    EventBatch* take(size_t max_events = SIZE_MAX);
+
+    // Hands what is waiting to the processors of manager as one batch, it is ordered by itself and not with the
+    // events submitted inside this process. Returns false if no batch was handed over, like take
+    // Can run while the pump or another thread calls move_to_processors
+    bool move_to(MultiEventManager& manager, size_t max_events = SIZE_MAX);
+
+    // Slots taken so far that were not a value event of this build, same thread as take
+    inline size_t dropped_events() const { return dropped; }
+};
+
+#ifdef EVENT_IMPLEMENTATION
+
+// A producer of another build can put any id and size in a slot, a handler reads sizeof its event
+inline bool is_value_slot(const ShmSlot& slot)
+{
+    return slot.id < max_event_types && slot.size != 0 && slot.size == value_event_size(slot.id);
+}
+
+ShmRingHeader* map_shm_ring(const std::string& name, size_t capacity, bool create, std::chrono::milliseconds timeout)
+{
+    int fd = shm_open(name.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+    if (fd < 0) throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+
+    if (create)
+    {
+        size_t bytes = ShmRingHeader::bytes(capacity);
+        void* memory = ftruncate(fd, (off_t) bytes) == 0 ? 
+            mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        int error = errno;
+        ::close(fd);
+        if (memory == MAP_FAILED)
+        {
+            shm_unlink(name.c_str());
+            throw std::system_error(error, std::generic_category(), "map " + name);
+        }
+
+        // The segment starts zeroed, so magic reads 0 until everything else is set
+        auto* ring = static_cast<ShmRingHeader*>(memory);
+        ring->version = ShmRingHeader::current_version;
+        ring->slot_bytes = (uint32_t) sizeof(ShmSlot);
+        ring->capacity = capacity;
+        ring->enqueue_pos.store(0, std::memory_order_relaxed);
+        ring->dequeue_pos.store(0, std::memory_order_relaxed);
+        for (size_t i = 0; i < capacity; i++)
+        {
+            ring->slots()[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        ring->magic.store(ShmRingHeader::magic_value, std::memory_order_release);
+        return ring;
+    }
+
+    // The creator may not have sized or published the ring yet
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;)
+    {
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "fstat " + name);
+        }
+
+        size_t bytes = (size_t) info.st_size;
+        if (bytes >= sizeof(ShmRingHeader))
+        {
+            void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (memory == MAP_FAILED)
+            {
+                int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "mmap " + name);
+            }
+
+            // Pairs with the release store of the creator, the other fields are only read after it
+            auto* ring = static_cast<ShmRingHeader*>(memory);
+            uint64_t magic = ring->magic.load(std::memory_order_acquire);
+            if (magic == ShmRingHeader::magic_value)
+            {
+                ::close(fd);
+                if (ring->version != ShmRingHeader::current_version || ring->slot_bytes != sizeof(ShmSlot) || 
+                    !std::has_single_bit(ring->capacity) || ShmRingHeader::bytes(ring->capacity) > bytes)
+                {
+                    munmap(memory, bytes);
+                    throw std::runtime_error("not an event ring " + name);
+                }
+                return ring;
+            }
+            munmap(memory, bytes);
+
+            if (magic != 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("not an event ring " + name);
+            }
+        }
+
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            ::close(fd);
+            throw std::runtime_error("event ring not ready " + name);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+ShmEventProducer::ShmEventProducer(const std::string& name)
+    : ring(map_shm_ring(name, 0, false)), mask(ring->capacity - 1) {}
+
+ShmEventProducer::~ShmEventProducer()
+{
+    munmap(ring, ShmRingHeader::bytes(ring->capacity));
+}
+
+ShmEventConsumer::ShmEventConsumer(const std::string& name, size_t capacity)
+    : name(name), ring(map_shm_ring(name, std::bit_ceil(std::max<size_t>(capacity, 2)), true)),
+    mask(ring->capacity - 1) {}
+
+ShmEventConsumer::~ShmEventConsumer()
+{
+    munmap(ring, ShmRingHeader::bytes(ring->capacity));
+    shm_unlink(name.c_str());
+}
+
+EventBatch* ShmEventConsumer::take(size_t max_events)
+{
+    uint64_t begin = ring->dequeue_pos.load(std::memory_order_relaxed);
+
+    // Published events up to the first ticket that is not, sizes first so the batch is allocated once
+    size_t count = 0, values = 0, record_bytes = 0;
+    for (uint64_t pos = begin; count < max_events; pos++, count++)
+    {
+        ShmSlot& slot = ring->slots()[pos & mask];
+        if (slot.sequence.load(std::memory_order_acquire) != pos + 1) break;
+        if (is_value_slot(slot))
+        {
+            record_bytes += sizeof(ValueRecord) + ((slot.size + 7) & ~size_t(7));
+            values++;
+        }
+    }
+    if (count == 0) return nullptr;
+    dropped += count - values;
+
+    EventBatch* batch = values ? EventBatch::create(0, 1, values, record_bytes) : nullptr;
+    ValueRecord* record = batch ? batch->records() : nullptr;
+    for (uint64_t pos = begin; pos != begin + count; pos++)
+    {
+        ShmSlot& slot = ring->slots()[pos & mask];
+        if (is_value_slot(slot))
+        {
+            record->id = slot.id;
+            record->size = (slot.size + 7) & ~uint32_t(7);
+            // The batch has room past the last record for a full size copy
+            memcpy(record->data(), slot.data, max_value_event_size);
+            record = record->next();
+        }
+
+        // Free for the producer that gets the ticket one lap later
+        slot.sequence.store(pos + ring->capacity, std::memory_order_release);
+    }
+    ring->dequeue_pos.store(begin + count, std::memory_order_relaxed);
+
+    return batch;
+}
+
+bool ShmEventConsumer::move_to(MultiEventManager& manager, size_t max_events)
+{
+    EventBatch* batch = take(max_events);
+    if (!batch) return false;
+
+    manager.add_batch(batch);
+    return true;
+}
+
+#endif